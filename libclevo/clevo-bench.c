@@ -0,0 +1,196 @@
+/*
+ * clevo-bench.c
+ *
+ * Copyright (C) 2022-2023 Slimbook <dev@slimbook.es>
+ *
+ * Compares the update rate of libclevo batches against writing each sysfs
+ * attribute on its own, the way ad hoc scripts do.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty  of
+ * MERCHANTABILITY or FITNESS FOR  A PARTICULAR  PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clevo.h"
+
+#define SYSFS_PATH "/sys/devices/platform/clevo_platform"
+
+/* one update: three zone colors and the brightness */
+#define WRITES_PER_UPDATE 4
+
+static const char *sysfs_path = SYSFS_PATH;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t color_of(int i, int zone)
+{
+	return (uint32_t)((i * 37 + zone * 85) & 0xFF) << (8 * zone);
+}
+
+static int sysfs_write(const char *attr, const char *value)
+{
+	char path[256];
+	ssize_t len = strlen(value);
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs_path, attr);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, value, len) != len) {
+		close(fd);
+		return -EIO;
+	}
+
+	return close(fd) ? -errno : 0;
+}
+
+static int naive_update(int i)
+{
+	static const char * const attrs[] = { "color_left", "color_center", "color_right" };
+	char value[16];
+	int zone;
+	int err;
+
+	for (zone = 0; zone < 3; zone++) {
+		snprintf(value, sizeof(value), "%06x\n", color_of(i, zone));
+		err = sysfs_write(attrs[zone], value);
+		if (err)
+			return err;
+	}
+
+	snprintf(value, sizeof(value), "%d\n", 100 + i % 100);
+
+	return sysfs_write("brightness", value);
+}
+
+static int batched_update(struct clevo *clevo, int i)
+{
+	int zone;
+	int err;
+
+	clevo_begin(clevo);
+	for (zone = 0; zone < 3; zone++)
+		clevo_set_zone(clevo, zone, color_of(i, zone));
+	clevo_set_brightness(clevo, 100 + i % 100);
+	err = clevo_commit(clevo);
+
+	return err;
+}
+
+static void report(const char *name, int updates, int writes, double seconds)
+{
+	printf("%-8s %8.1f updates/s %10.1f us/update %3d writes/update\n",
+		name, updates / seconds, seconds * 1e6 / updates, writes);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-p sysfs_dir] [-d control_device]\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *ctl_path = CLEVO_CTL_PATH;
+	struct clevo_state saved;
+	struct clevo *clevo;
+	int iterations = 200;
+	double start, naive, batched;
+	int opt;
+	int err;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:p:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'p':
+			sysfs_path = optarg;
+			break;
+		case 'd':
+			ctl_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (iterations <= 0)
+		usage(argv[0]);
+
+	clevo = clevo_open_path(ctl_path);
+	if (!clevo) {
+		fprintf(stderr, "%s: %s\n", ctl_path, strerror(errno));
+		return 1;
+	}
+
+	err = clevo_snapshot(clevo, &saved);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", ctl_path, strerror(-err));
+		clevo_close(clevo);
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < iterations && !err; i++)
+		err = naive_update(i);
+	naive = now() - start;
+	if (err)
+		goto out;
+
+	start = now();
+	for (i = 0; i < iterations && !err; i++)
+		err = batched_update(clevo, i);
+	batched = now() - start;
+	if (err)
+		goto out;
+
+	report("sysfs", iterations, WRITES_PER_UPDATE, naive);
+	report("libclevo", iterations, 1, batched);
+	printf("speedup  %8.2fx\n", naive / batched);
+
+out:
+	if (err)
+		fprintf(stderr, "update failed: %s\n", strerror(-err));
+
+	// put the keyboard back the way it was
+	clevo_begin(clevo);
+	clevo_set_pattern(clevo, saved.pattern);
+	for (i = 0; i < CLEVO_ZONE_COUNT; i++)
+		clevo_set_zone(clevo, i, saved.color[i]);
+	clevo_set_brightness(clevo, saved.brightness);
+	clevo_set_enabled(clevo, saved.enabled);
+	clevo_commit(clevo);
+
+	clevo_close(clevo);
+
+	return err ? 1 : 0;
+}
@@ -0,0 +1,300 @@
+/*
+ * clevo.c
+ *
+ * Copyright (C) 2022-2023 Slimbook <dev@slimbook.es>
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty  of
+ * MERCHANTABILITY or FITNESS FOR  A PARTICULAR  PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clevo.h"
+
+#define CLEVO_PENDING_ZONE(zone) (1u << (zone))
+#define CLEVO_PENDING_ZONES ((1u << CLEVO_ZONE_COUNT) - 1)
+#define CLEVO_PENDING_PATTERN (1u << CLEVO_ZONE_COUNT)
+#define CLEVO_PENDING_BRIGHTNESS (1u << (CLEVO_ZONE_COUNT + 1))
+#define CLEVO_PENDING_ENABLED (1u << (CLEVO_ZONE_COUNT + 2))
+
+/* room for every key=value pair of one write */
+#define CLEVO_LINE_LEN 256
+
+static const char * const zone_keys[CLEVO_ZONE_COUNT] = {
+	"color_left", "color_center", "color_right", "color_extra"
+};
+
+struct clevo {
+	int fd;
+	int rgb;
+	int batch_depth;
+	unsigned int pending;    /* CLEVO_PENDING_* fields not yet written */
+	struct clevo_state next; /* values of the pending fields */
+};
+
+static int clevo_write(struct clevo *clevo, const char *line, size_t len)
+{
+	ssize_t written;
+
+	do {
+		written = write(clevo->fd, line, len);
+	} while (written < 0 && errno == EINTR);
+
+	if (written < 0)
+		return -errno;
+
+	return (size_t)written == len ? 0 : -EIO;
+}
+
+static int clevo_flush(struct clevo *clevo)
+{
+	char line[CLEVO_LINE_LEN];
+	size_t len = 0;
+	int zone;
+	int err;
+
+	if (!clevo->pending)
+		return 0;
+
+	if (clevo->pending & CLEVO_PENDING_PATTERN)
+		len += snprintf(line + len, sizeof(line) - len, "pattern=%s ", clevo->next.pattern);
+
+	for (zone = 0; zone < CLEVO_ZONE_COUNT; zone++) {
+		if (clevo->pending & CLEVO_PENDING_ZONE(zone))
+			len += snprintf(line + len, sizeof(line) - len, "%s=%06x ",
+					zone_keys[zone], clevo->next.color[zone] & 0xFFFFFF);
+	}
+
+	if (clevo->pending & CLEVO_PENDING_BRIGHTNESS)
+		len += snprintf(line + len, sizeof(line) - len, "brightness=%u ", clevo->next.brightness);
+
+	if (clevo->pending & CLEVO_PENDING_ENABLED)
+		len += snprintf(line + len, sizeof(line) - len, "state=%d ", clevo->next.enabled);
+
+	line[len - 1] = '\n';
+
+	err = clevo_write(clevo, line, len);
+	if (!err)
+		clevo->pending = 0;
+
+	return err;
+}
+
+static int clevo_set(struct clevo *clevo, unsigned int fields)
+{
+	clevo->pending |= fields;
+
+	if (clevo->batch_depth)
+		return 0;
+
+	return clevo_flush(clevo);
+}
+
+static int clevo_parse(char *line, struct clevo_state *state)
+{
+	char *save = NULL;
+	char *token, *value;
+	int zone;
+
+	memset(state, 0, sizeof(*state));
+
+	for (token = strtok_r(line, " \n", &save); token; token = strtok_r(NULL, " \n", &save)) {
+		value = strchr(token, '=');
+		if (!value)
+			return -EPROTO;
+		*value++ = '\0';
+
+		if (!strcmp(token, "type")) {
+			state->rgb = !strcmp(value, "rgb");
+		}
+		else if (!strcmp(token, "state")) {
+			state->enabled = strtoul(value, NULL, 10);
+		}
+		else if (!strcmp(token, "brightness")) {
+			state->brightness = strtoul(value, NULL, 10);
+		}
+		else if (!strcmp(token, "pattern")) {
+			snprintf(state->pattern, sizeof(state->pattern), "%s", value);
+		}
+		else {
+			for (zone = 0; zone < CLEVO_ZONE_COUNT; zone++) {
+				if (!strcmp(token, zone_keys[zone]))
+					state->color[zone] = strtoul(value, NULL, 16);
+			}
+		}
+	}
+
+	return 0;
+}
+
+struct clevo *clevo_open_path(const char *path)
+{
+	struct clevo_state state;
+	struct clevo *clevo;
+	int err;
+
+	clevo = calloc(1, sizeof(*clevo));
+	if (!clevo)
+		return NULL;
+
+	clevo->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (clevo->fd < 0) {
+		free(clevo);
+		return NULL;
+	}
+
+	// the keyboard type never changes, ask once
+	err = clevo_snapshot(clevo, &state);
+	if (err) {
+		clevo_close(clevo);
+		errno = -err;
+		return NULL;
+	}
+	clevo->rgb = state.rgb;
+
+	return clevo;
+}
+
+struct clevo *clevo_open(void)
+{
+	return clevo_open_path(CLEVO_CTL_PATH);
+}
+
+void clevo_close(struct clevo *clevo)
+{
+	if (!clevo)
+		return;
+
+	close(clevo->fd);
+	free(clevo);
+}
+
+int clevo_begin(struct clevo *clevo)
+{
+	clevo->batch_depth++;
+
+	return 0;
+}
+
+int clevo_commit(struct clevo *clevo)
+{
+	if (!clevo->batch_depth)
+		return -EINVAL;
+
+	if (--clevo->batch_depth)
+		return 0;
+
+	return clevo_flush(clevo);
+}
+
+int clevo_set_enabled(struct clevo *clevo, int enabled)
+{
+	clevo->next.enabled = !!enabled;
+
+	return clevo_set(clevo, CLEVO_PENDING_ENABLED);
+}
+
+int clevo_set_brightness(struct clevo *clevo, unsigned int brightness)
+{
+	if (brightness > CLEVO_BRIGHTNESS_MAX)
+		return -EINVAL;
+
+	clevo->next.brightness = brightness;
+
+	return clevo_set(clevo, CLEVO_PENDING_BRIGHTNESS);
+}
+
+int clevo_set_zone(struct clevo *clevo, enum clevo_zone zone, uint32_t color)
+{
+	if (zone < 0 || zone >= CLEVO_ZONE_COUNT || color > 0xFFFFFF)
+		return -EINVAL;
+
+	clevo->next.color[zone] = color;
+
+	return clevo_set(clevo, CLEVO_PENDING_ZONE(zone));
+}
+
+int clevo_set_zones(struct clevo *clevo, uint32_t color)
+{
+	int zone;
+
+	if (color > 0xFFFFFF)
+		return -EINVAL;
+
+	for (zone = 0; zone < CLEVO_ZONE_COUNT; zone++)
+		clevo->next.color[zone] = color;
+
+	return clevo_set(clevo, CLEVO_PENDING_ZONES);
+}
+
+int clevo_set_pattern(struct clevo *clevo, const char *pattern)
+{
+	size_t len = strlen(pattern);
+
+	if (!len || len >= sizeof(clevo->next.pattern) || strpbrk(pattern, " \t\n="))
+		return -EINVAL;
+
+	memcpy(clevo->next.pattern, pattern, len + 1);
+
+	return clevo_set(clevo, CLEVO_PENDING_PATTERN);
+}
+
+int clevo_snapshot(struct clevo *clevo, struct clevo_state *state)
+{
+	char line[CLEVO_LINE_LEN];
+	ssize_t len;
+
+	do {
+		len = pread(clevo->fd, line, sizeof(line) - 1, 0);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		return -errno;
+
+	line[len] = '\0';
+
+	return clevo_parse(line, state);
+}
+
+int clevo_is_rgb(struct clevo *clevo)
+{
+	return clevo->rgb;
+}
+
+int clevo_lease(struct clevo *clevo, int wait)
+{
+	int flags = fcntl(clevo->fd, F_GETFL);
+	int err;
+
+	if (flags < 0)
+		return -errno;
+
+	if (fcntl(clevo->fd, F_SETFL, wait ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) < 0)
+		return -errno;
+
+	err = clevo_write(clevo, "lease\n", 6);
+
+	fcntl(clevo->fd, F_SETFL, flags);
+
+	return err;
+}
+
+int clevo_release(struct clevo *clevo)
+{
+	return clevo_write(clevo, "release\n", 8);
+}
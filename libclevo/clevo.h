@@ -0,0 +1,88 @@
+/*
+ * clevo.h
+ *
+ * Copyright (C) 2022-2023 Slimbook <dev@slimbook.es>
+ *
+ * Userspace access to the clevo_platform keyboard backlight through its
+ * control device. A handle keeps the device open; changes made between
+ * clevo_begin() and clevo_commit() reach the driver as a single write.
+ *
+ * This program is free software;  you can redistribute it and/or modify
+ * it under the terms of the  GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty  of
+ * MERCHANTABILITY or FITNESS FOR  A PARTICULAR  PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should  have received  a copy of  the GNU General  Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLEVO_H
+#define CLEVO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CLEVO_CTL_PATH "/dev/clevo_platform"
+
+#define CLEVO_BRIGHTNESS_MAX 255
+#define CLEVO_PATTERN_LEN 16
+
+enum clevo_zone {
+	CLEVO_ZONE_LEFT,
+	CLEVO_ZONE_CENTER,
+	CLEVO_ZONE_RIGHT,
+	CLEVO_ZONE_EXTRA,
+	CLEVO_ZONE_COUNT
+};
+
+struct clevo_state {
+	int rgb;                           /* 0 = single color keyboard */
+	int enabled;
+	unsigned int brightness;           /* 0-255 on every keyboard type */
+	char pattern[CLEVO_PATTERN_LEN];   /* effect name, e.g. "CUSTOM" */
+	uint32_t color[CLEVO_ZONE_COUNT];  /* 0xRRGGBB */
+};
+
+struct clevo;
+
+/* NULL and errno set on failure */
+struct clevo *clevo_open(void);
+struct clevo *clevo_open_path(const char *path);
+void clevo_close(struct clevo *clevo);
+
+/*
+ * All calls below return 0 or a negative errno. Outside a batch every
+ * setter is written at once; inside one they are merged, a later value
+ * replacing an earlier one, and sent by the outermost clevo_commit().
+ */
+int clevo_begin(struct clevo *clevo);
+int clevo_commit(struct clevo *clevo);
+
+int clevo_set_enabled(struct clevo *clevo, int enabled);
+int clevo_set_brightness(struct clevo *clevo, unsigned int brightness);
+int clevo_set_zone(struct clevo *clevo, enum clevo_zone zone, uint32_t color);
+int clevo_set_zones(struct clevo *clevo, uint32_t color);
+int clevo_set_pattern(struct clevo *clevo, const char *pattern);
+
+int clevo_snapshot(struct clevo *clevo, struct clevo_state *state);
+
+/* 1 for RGB keyboards, 0 for single color ones */
+int clevo_is_rgb(struct clevo *clevo);
+
+/* exclusive access, see the lease attribute of the driver */
+int clevo_lease(struct clevo *clevo, int wait);
+int clevo_release(struct clevo *clevo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,6 +33,30 @@
 #include <acpi/acpi_drivers.h>
 #include <linux/platform_device.h>
 #include <linux/version.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/jump_label.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/input.h>
+#include <linux/fb.h>
+#include <linux/suspend.h>
+#if IS_REACHABLE(CONFIG_IIO)
+#include <linux/iio/iio.h>
+#include <linux/iio/consumer.h>
+#include <linux/iio/types.h>
+#endif
 
 #define MODULE_NAME KBUILD_MODNAME
 
@@ -52,6 +76,7 @@ MODULE_LICENSE("GPL");
 #define WMI_SUBMETHOD_ID_GET_AP 0x46
 #define WMI_SUBMETHOD_ID_SET_KB_LEDS 0x67
 #define WMI_SUBMETHOD_ID_SET_KB_LEDS_BW 0x27
+#define WMI_SUBMETHOD_ID_GET_KB_LEDS_BW 0x3D
 #define WMI_SUBMETHOD_ID_GET_BIOS_1 0x52
 #define WMI_SUBMETHOD_ID_GET_BIOS_2 0x7A
 
@@ -78,6 +103,27 @@ MODULE_LICENSE("GPL");
 #define KB_COLOR_DEFAULT 0xFFFFFF
 #define DEFAULT_BLINKING_PATTERN 0
 
+#define ZONE_LEFT 0
+#define ZONE_CENTER 1
+#define ZONE_RIGHT 2
+#define ZONE_EXTRA 3
+#define ZONE_COUNT 4
+
+// fields of kbd_led_state that still have to be written to the firmware
+#define KBD_DIRTY_ZONE(zone) BIT(zone)
+#define KBD_DIRTY_ZONES GENMASK(ZONE_COUNT - 1, 0)
+#define KBD_DIRTY_PATTERN BIT(ZONE_COUNT)
+#define KBD_DIRTY_BRIGHTNESS BIT(ZONE_COUNT + 1)
+#define KBD_DIRTY_ENABLED BIT(ZONE_COUNT + 2)
+#define KBD_DIRTY_ALL GENMASK(ZONE_COUNT + 2, 0)
+
+// firmware command classes, in order of priority
+#define CLEVO_CMD_HOTKEY 0
+#define CLEVO_CMD_RESUME 1
+#define CLEVO_CMD_USER 2
+#define CLEVO_CMD_EFFECT 3
+#define CLEVO_CMD_CLASSES 4
+
 #define CLEVO_MODEL_UNKNOWN 0x00
 #define CLEVO_MODEL_V1 0x01
 #define CLEVO_MODEL_V2 0x02
@@ -85,8 +131,67 @@ MODULE_LICENSE("GPL");
 #define KB_TYPE_BW 0
 #define KB_TYPE_RGB 1
 
+/*
+ * Single-model builds (see Makefile) compile out the unused firmware backend
+ * and/or keyboard type: CLEVO_ONLY_V1, CLEVO_ONLY_V2, CLEVO_ONLY_RGB, CLEVO_ONLY_BW
+ */
+#if defined(CLEVO_ONLY_V1) && defined(CLEVO_ONLY_V2)
+#error "CLEVO_ONLY_V1 and CLEVO_ONLY_V2 are mutually exclusive"
+#endif
+#if defined(CLEVO_ONLY_RGB) && defined(CLEVO_ONLY_BW)
+#error "CLEVO_ONLY_RGB and CLEVO_ONLY_BW are mutually exclusive"
+#endif
+
+#ifdef CLEVO_ONLY_V2
+#define CLEVO_HAS_V1 0
+#else
+#define CLEVO_HAS_V1 1
+#endif
+
+#ifdef CLEVO_ONLY_V1
+#define CLEVO_HAS_V2 0
+#else
+#define CLEVO_HAS_V2 1
+#endif
+
+#ifdef CLEVO_ONLY_BW
+#define CLEVO_HAS_RGB 0
+#else
+#define CLEVO_HAS_RGB 1
+#endif
+
+#ifdef CLEVO_ONLY_RGB
+#define CLEVO_HAS_BW 0
+#else
+#define CLEVO_HAS_BW 1
+#endif
+
 u32 model = CLEVO_MODEL_UNKNOWN;
 
+// model and keyboard type never change after detection, patch them in
+static DEFINE_STATIC_KEY_FALSE(clevo_v1_key);
+static DEFINE_STATIC_KEY_FALSE(clevo_rgb_key);
+
+static __always_inline bool clevo_backend_is_v1(void)
+{
+	if (!CLEVO_HAS_V2)
+		return true;
+	if (!CLEVO_HAS_V1)
+		return false;
+
+	return static_branch_unlikely(&clevo_v1_key);
+}
+
+static __always_inline bool clevo_kbd_is_rgb(void)
+{
+	if (!CLEVO_HAS_BW)
+		return true;
+	if (!CLEVO_HAS_RGB)
+		return false;
+
+	return static_branch_unlikely(&clevo_rgb_key);
+}
+
 struct acpi_device *active_device = NULL;
 
 bool quirk_force_rgb_keyboard = false;
@@ -136,6 +241,11 @@ static struct color_list_t color_list = {
 		{.name = "WHITE", .code = 0xFFFFFF},   // 7
 	}};
 
+/*
+ * Firmware effects run entirely on the EC. The values are the ones known to
+ * work; the fields inside them (speed, direction, ...) are undocumented, so
+ * they are sent unchanged.
+ */
 struct blinking_pattern_t {
 	u8 key;
 	u32 value;
@@ -185,6 +295,43 @@ static struct kbd_led_state_t kbd_led_state = {
 
 };
 
+// serializes kbd_led_state updates and the firmware writes derived from them
+static DEFINE_MUTEX(kbd_lock);
+
+static const u32 zone_regions[ZONE_COUNT] = {
+	REGION_LEFT, REGION_CENTER, REGION_RIGHT, REGION_EXTRA
+};
+
+/*
+ * kbd_led_state always holds the requested state, kbd_dirty the fields the
+ * firmware has not seen yet. Writes that would not be visible (backlight off,
+ * system suspending) stay dirty until clevo_keyboard_commit() can flush them.
+ */
+static u32 kbd_dirty;
+static u32 kbd_deferred; /* dirty fields held back while invisible */
+static bool kbd_suspended;
+
+// sources that hold the backlight off without touching kbd_led_state
+#define KBD_OFF_LID BIT(0)
+#define KBD_OFF_BLANK BIT(1)
+#define KBD_OFF_SUSPEND BIT(2)
+#define KBD_OFF_EVENTS (KBD_OFF_LID | KBD_OFF_BLANK)
+
+static u32 kbd_forced_off;
+
+static struct {
+	u64 deferred;
+	u64 flushed;
+} kbd_defer_stats;
+
+static struct {
+	u64 reads;
+	u64 failed;
+	u64 matched;   /* firmware already showed the requested state */
+	u64 adopted;   /* firmware changed on its own, taken over */
+	u64 corrected; /* firmware drifted, requested state written again */
+} kbd_reconcile_stats;
+
 
 // forward declarations
 
@@ -198,10 +345,23 @@ static void set_brightness(u8 brightness);
 
 static void set_enabled(u8 state);
 
-static int set_color(u32 region, u32 color);
+static void set_blinking_pattern(u8 blinkling_pattern);
+
+static int set_color_code_region(u32 region, u32 colorcode);
+
+static void clevo_keyboard_commit(u8 cmd_class);
+static bool clevo_keyboard_commit_user(void);
+
+static void clevo_sched_sync(void);
+static int clevo_keyboard_reconcile(u8 cmd_class, bool adopt);
+
+static int clevo_lease_lock(struct file *file);
+
+static void clevo_reactive_update(void);
 
 static int set_color_string_region(const char *color_string, size_t size, u32 region)
 {
+	bool wait;
 	u32 colorcode;
 	int err = kstrtouint(color_string, 16, &colorcode);
 
@@ -209,24 +369,16 @@ static int set_color_string_region(const char *color_string, size_t size, u32 re
 		return err;
 	}
 
-	if (!set_color(region, colorcode)) {
-		// after succesfully setting color, update our state struct
-		// depending on which region was changed
-		switch (region) {
-		case REGION_LEFT:
-			kbd_led_state.color.left = colorcode;
-			break;
-		case REGION_CENTER:
-			kbd_led_state.color.center = colorcode;
-			break;
-		case REGION_RIGHT:
-			kbd_led_state.color.right = colorcode;
-			break;
-		case REGION_EXTRA:
-			kbd_led_state.color.extra = colorcode;
-			break;
-		}
-	}
+	err = clevo_lease_lock(NULL);
+	if (err)
+		return err;
+
+	set_color_code_region(region, colorcode);
+	wait = clevo_keyboard_commit_user();
+	mutex_unlock(&kbd_lock);
+
+	if (wait)
+		clevo_sched_sync();
 
 	return size;
 }
@@ -277,6 +429,138 @@ module_param_cb(brightness, &param_ops_brightness_ops, &param_brightness,
 		S_IWUSR|S_IRUGO);
 MODULE_PARM_DESC(brightness, "Set the Keyboard Brightness");
 
+static char *param_als_device = "";
+module_param_named(als_device, param_als_device, charp, S_IRUGO);
+MODULE_PARM_DESC(als_device,
+		 "Name of the IIO device used as ambient light sensor (empty = disabled)");
+
+static int param_als_channel = -1;
+module_param_named(als_channel, param_als_channel, int, S_IRUGO);
+MODULE_PARM_DESC(als_channel,
+		 "IIO channel index to read, -1 = first light channel");
+
+static uint param_als_poll_ms = 1000;
+module_param_named(als_poll_ms, param_als_poll_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(als_poll_ms, "Ambient light sensor polling interval (ms)");
+
+static uint param_als_lux_dark = 10;
+module_param_named(als_lux_dark, param_als_lux_dark, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(als_lux_dark, "Lux at or below which the backlight is at full brightness");
+
+static uint param_als_lux_bright = 400;
+module_param_named(als_lux_bright, param_als_lux_bright, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(als_lux_bright, "Lux at or above which the backlight is off");
+
+static uint param_als_hysteresis = 20;
+module_param_named(als_hysteresis, param_als_hysteresis, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(als_hysteresis,
+		 "Hysteresis around a brightness step, in percent of the step width");
+
+static uint param_sched_depth[CLEVO_CMD_CLASSES] = { 8, 8, 16, 4 };
+module_param_array_named(sched_depth, param_sched_depth, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(sched_depth,
+		 "Queue depth limit per firmware command class: hotkey,resume,user,effect");
+
+static bool param_lid_off = true;
+module_param_named(lid_off, param_lid_off, bool, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(lid_off, "Switch the backlight off while the lid is closed");
+
+// fbdev blank events, these only cover the console and not DRM/KMS DPMS
+#if IS_ENABLED(CONFIG_FB_NOTIFY) && defined(FB_EVENT_BLANK)
+#define CLEVO_FB_BLANK 1
+#else
+#define CLEVO_FB_BLANK 0
+#endif
+
+static bool param_blank_off = CLEVO_FB_BLANK;
+module_param_named(blank_off, param_blank_off, bool, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(blank_off,
+		 "Switch the backlight off while the console is blanked (fbdev only, not X/Wayland DPMS; needs CONFIG_FB_NOTIFY)");
+
+static uint param_fade_ms = 200;
+module_param_named(fade_ms, param_fade_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(fade_ms,
+		 "Duration of hotkey, toggle and resume brightness fades on RGB keyboards, 0 = off (ms)");
+
+static uint param_fade_steps = 6;
+module_param_named(fade_steps, param_fade_steps, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(fade_steps, "Maximum intermediate brightness writes per fade");
+
+static int reactive_param_set(const char *value, const struct kernel_param *kp)
+{
+	int err = param_set_bool(value, kp);
+
+	if (!err)
+		clevo_reactive_update();
+
+	return err;
+}
+
+static const struct kernel_param_ops param_ops_reactive_ops = {
+	.set = reactive_param_set,
+	.get = param_get_bool,
+};
+
+static bool param_reactive = false;
+module_param_cb(reactive, &param_ops_reactive_ops, &param_reactive, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(reactive, "Light up the keyboard zone of each pressed key (RGB keyboards)");
+
+static uint param_reactive_color = 0xFFFFFF;
+module_param_named(reactive_color, param_reactive_color, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(reactive_color, "Color of the typing reaction (RRGGBB)");
+
+static uint param_reactive_decay_ms = 400;
+module_param_named(reactive_decay_ms, param_reactive_decay_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(reactive_decay_ms, "Time a zone takes to fade back after a key press (ms)");
+
+static uint param_reactive_fps = 20;
+module_param_named(reactive_fps, param_reactive_fps, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(reactive_fps, "Maximum firmware updates per second for the typing reaction");
+
+static bool param_s2idle_fast = false;
+module_param_named(s2idle_fast, param_s2idle_fast, bool, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(s2idle_fast,
+		 "Trust the firmware to keep the RGB backlight state over s2idle and only switch it back on at resume "
+		 "(single color keyboards read the state back instead)");
+
+static bool param_write_behind = false;
+module_param_named(write_behind, param_write_behind, bool, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(write_behind,
+		 "Return from sysfs writes at once and commit in the background, see the commit attribute");
+
+static uint param_write_behind_ms = 20;
+module_param_named(write_behind_ms, param_write_behind_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(write_behind_ms,
+		 "How long write-behind collects sysfs writes before committing them (ms)");
+
+static char *param_backend = "auto";
+module_param_named(backend, param_backend, charp, S_IRUGO);
+MODULE_PARM_DESC(backend,
+		 "Firmware backend for commands: auto (fastest at probe), wmi or acpi");
+
+static bool param_lease_wait = false;
+module_param_named(lease_wait, param_lease_wait, bool, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(lease_wait,
+		 "Queue writes from other clients while a control lease is held instead of rejecting them");
+
+static uint param_power_mw = 0;
+module_param_named(power_mw, param_power_mw, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(power_mw,
+		 "Backlight power at full brightness (white on RGB) used for energy estimates, 0 = rough per keyboard type guess (mW)");
+
+static uint param_retry_base_ms = 50;
+module_param_named(retry_base_ms, param_retry_base_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(retry_base_ms, "Delay before retrying a failed firmware write (ms)");
+
+static uint param_retry_max_ms = 5000;
+module_param_named(retry_max_ms, param_retry_max_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(retry_max_ms, "Upper bound of the exponential retry backoff (ms)");
+
+static uint param_als_min_interval_ms = 3000;
+module_param_named(als_min_interval_ms, param_als_min_interval_ms, uint, S_IWUSR|S_IRUGO);
+MODULE_PARM_DESC(als_min_interval_ms,
+		 "Minimum time between two ambient light driven brightness changes (ms)");
+
 
 // Param callback functions
 
@@ -312,6 +596,79 @@ static int brightness_validator(const char *value,
 
 // ATTR fs functions
 
+static void clevo_keyboard_commit_work_fn(struct work_struct *work)
+{
+	mutex_lock(&kbd_lock);
+	clevo_keyboard_commit(CLEVO_CMD_USER);
+	mutex_unlock(&kbd_lock);
+}
+
+static DECLARE_DELAYED_WORK(kbd_commit_work, clevo_keyboard_commit_work_fn);
+
+/*
+ * Commits a sysfs write, called with kbd_lock held. Returns whether the
+ * writer should wait for the firmware; in write-behind mode the state is
+ * only queued and committed together with whatever follows it.
+ */
+static bool clevo_keyboard_commit_user(void)
+{
+	if (param_write_behind) {
+		queue_delayed_work(system_wq, &kbd_commit_work,
+				   msecs_to_jiffies(param_write_behind_ms));
+		return false;
+	}
+
+	clevo_keyboard_commit(CLEVO_CMD_USER);
+	return true;
+}
+
+// commit barrier: returns once every pending write has reached the firmware
+static ssize_t set_commit_fs(struct device *child, struct device_attribute *attr,
+			     const char *buffer, size_t size)
+{
+	flush_delayed_work(&kbd_commit_work);
+
+	mutex_lock(&kbd_lock);
+	clevo_keyboard_commit(CLEVO_CMD_USER);
+	mutex_unlock(&kbd_lock);
+
+	clevo_sched_sync();
+
+	return size;
+}
+
+static DEVICE_ATTR(commit, 0200, NULL, set_commit_fs);
+
+// brightness as written by users is always 0-255
+static u8 clevo_user_brightness(unsigned int val)
+{
+	val = clamp_t(u8, val, BRIGHTNESS_MIN, BRIGHTNESS_MAX);
+	
+	if (!clevo_kbd_is_rgb()) {
+		int ratio = BRIGHTNESS_MAX/BRIGHTNESS_MAX_BW;
+		val = val / ratio;
+	}
+
+	return val;
+}
+
+// pattern by name or by index, -EINVAL if there is no such pattern
+static int clevo_parse_pattern(const char *token)
+{
+	unsigned int num;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(blinking_patterns); i++) {
+		if (!strcasecmp(token, blinking_patterns[i].name))
+			return i;
+	}
+
+	if (!kstrtouint(token, 10, &num) && num < ARRAY_SIZE(blinking_patterns))
+		return num;
+
+	return -EINVAL;
+}
+
 static ssize_t show_brightness_fs(struct device *child,
 				  struct device_attribute *attr, char *buffer)
 {
@@ -323,20 +680,25 @@ static ssize_t set_brightness_fs(struct device *child,
                                  const char *buffer, size_t size)
 {
 	unsigned int val;
+	bool wait;
 
 	int err = kstrtouint(buffer, 0, &val);
 	if (err) {
 		return err;
 	}
 
-	val = clamp_t(u8, val, BRIGHTNESS_MIN, BRIGHTNESS_MAX);
-	
-	if (kbd_led_state.mode == KB_TYPE_BW) {
-		int ratio = BRIGHTNESS_MAX/BRIGHTNESS_MAX_BW;
-		val = val / ratio;
-	}
-	
+	val = clevo_user_brightness(val);
+
+	err = clevo_lease_lock(NULL);
+	if (err)
+		return err;
+
 	set_brightness(val);
+	wait = clevo_keyboard_commit_user();
+	mutex_unlock(&kbd_lock);
+
+	if (wait)
+		clevo_sched_sync();
 
 	return size;
 }
@@ -351,6 +713,7 @@ static ssize_t set_state_fs(struct device *child, struct device_attribute *attr,
 			    const char *buffer, size_t size)
 {
 	unsigned int state;
+	bool wait;
 
 	int err = kstrtouint(buffer, 0, &state);
 	if (err) {
@@ -359,7 +722,16 @@ static ssize_t set_state_fs(struct device *child, struct device_attribute *attr,
 
 	state = clamp_t(u8, state, 0, 1);
 
+	err = clevo_lease_lock(NULL);
+	if (err)
+		return err;
+
 	set_enabled(state);
+	wait = clevo_keyboard_commit_user();
+	mutex_unlock(&kbd_lock);
+
+	if (wait)
+		clevo_sched_sync();
 
 	return size;
 }
@@ -403,14 +775,117 @@ static ssize_t set_color_right_fs(struct device *child,
 	return set_color_string_region(color_string, size, REGION_RIGHT);
 }
 
+static ssize_t show_deferred_fs(struct device *child,
+				struct device_attribute *attr, char *buffer)
+{
+	u64 deferred, flushed;
+	u32 pending;
+
+	mutex_lock(&kbd_lock);
+	deferred = kbd_defer_stats.deferred;
+	flushed = kbd_defer_stats.flushed;
+	pending = hweight32(kbd_deferred);
+	mutex_unlock(&kbd_lock);
+
+	return sprintf(buffer, "deferred: %llu\nflushed: %llu\npending: %u\nsaved: %llu\n",
+		       deferred, flushed, pending, deferred - flushed - pending);
+}
+
+static ssize_t show_effect_fs(struct device *child,
+			      struct device_attribute *attr, char *buffer)
+{
+	ssize_t len;
+
+	mutex_lock(&kbd_lock);
+	len = sprintf(buffer, "%s\n", blinking_patterns[kbd_led_state.blinking_pattern].name);
+	mutex_unlock(&kbd_lock);
+
+	return len;
+}
+
+/*
+ * Accepts "<pattern> [color=RRGGBB]" with the pattern given by name or index.
+ * color is written to every zone before the effect starts, for effects that
+ * animate the stored zone colors.
+ */
+static ssize_t set_effect_fs(struct device *child,
+			     struct device_attribute *attr,
+			     const char *buffer, size_t size)
+{
+	const struct blinking_pattern_t *pattern;
+	char *buf, *cursor, *token, *value;
+	bool has_color = false;
+	bool wait;
+	unsigned int color = 0;
+	ssize_t err = -EINVAL;
+	int i;
+
+	if (!clevo_kbd_is_rgb())
+		return -EOPNOTSUPP;
+
+	buf = kstrndup(buffer, size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cursor = strim(buf);
+	token = strsep(&cursor, " \t");
+
+	i = clevo_parse_pattern(token);
+	if (i < 0)
+		goto out;
+	pattern = &blinking_patterns[i];
+
+	while ((token = strsep(&cursor, " \t")) != NULL) {
+		if (!*token)
+			continue;
+
+		value = strchr(token, '=');
+		if (!value)
+			goto out;
+		*value++ = '\0';
+
+		if (!strcmp(token, "color")) {
+			if (kstrtouint(value, 16, &color) || color > 0xFFFFFF)
+				goto out;
+			has_color = true;
+		}
+		else {
+			goto out;
+		}
+	}
+
+	err = clevo_lease_lock(NULL);
+	if (err)
+		goto out;
+
+	set_blinking_pattern(pattern->key);
+
+	for (i = 0; has_color && i < ZONE_COUNT; i++)
+		set_color_code_region(zone_regions[i], color);
+
+	wait = clevo_keyboard_commit_user();
+
+	mutex_unlock(&kbd_lock);
+
+	if (wait)
+		clevo_sched_sync();
+
+	err = size;
+out:
+	kfree(buf);
+	return err;
+}
+
 static DEVICE_ATTR(brightness, 0644, show_brightness_fs, set_brightness_fs);
 static DEVICE_ATTR(state, 0644, show_state_fs, set_state_fs);
 static DEVICE_ATTR(color_left, 0644, show_color_left_fs, set_color_left_fs);
 static DEVICE_ATTR(color_center, 0644, show_color_center_fs, set_color_center_fs);
 static DEVICE_ATTR(color_right, 0644, show_color_right_fs, set_color_right_fs);
+static DEVICE_ATTR(deferred, 0444, show_deferred_fs, NULL);
+static DEVICE_ATTR(effect, 0644, show_effect_fs, set_effect_fs);
 
 
-static u32 clevo_wmi_evaluate_wmbb_method(u32 method_id, u32 arg,
+static int clevo_wmi_evaluate_wmbb_method(u32 method_id, u32 arg,
 	u32 *retval)
 {
 	struct acpi_buffer in  = { (acpi_size) sizeof(arg), &arg };
@@ -449,9 +924,9 @@ exit:
 	return 0;
 }
 
-static u32 clevo_acpi_evaluate_method(struct acpi_device *device, u8 cmd, u32 arg, u32 *result)
+static int clevo_acpi_evaluate_method(struct acpi_device *device, u8 cmd, u32 arg, u32 *result)
 {
-	u32 status;
+	int status;
 	acpi_handle handle;
 	u64 dsm_rev_dummy = 0x00; // Dummy 0 value since not used
 	u64 dsm_func = cmd;
@@ -482,8 +957,8 @@ static u32 clevo_acpi_evaluate_method(struct acpi_device *device, u8 cmd, u32 ar
 	out_obj = acpi_evaluate_dsm(handle, &clevo_acpi_dsm_uuid, dsm_rev_dummy, dsm_func, &dsm_argv4);
 	if (!out_obj)
 	{
-		pr_err("failed to evaluate _DSM\n");
-		status = -1;
+		pr_err_ratelimited("failed to evaluate _DSM\n");
+		status = -EIO;
 	}
 	else
 	{
@@ -504,343 +979,2726 @@ static u32 clevo_acpi_evaluate_method(struct acpi_device *device, u8 cmd, u32 ar
 	return status;
 }
 
-static u32 clevo_evaluate_method(u32 cmd, u32 arg, u32 *result)
+static int clevo_evaluate_method(u32 cmd, u32 arg, u32 *result)
 {
-	u32 status;
-	// using ACPI method call
-	if (model == CLEVO_MODEL_V2) {
-		status = clevo_acpi_evaluate_method(active_device, cmd, arg, result);
+	// GET_AP arms event delivery, it goes to the interface events come from
+	if (cmd == WMI_SUBMETHOD_ID_GET_AP) {
+		if (CLEVO_HAS_V1 && model == CLEVO_MODEL_V1)
+			return clevo_wmi_evaluate_wmbb_method(cmd, arg, result);
+		if (CLEVO_HAS_V2 && model == CLEVO_MODEL_V2)
+			return clevo_acpi_evaluate_method(active_device, cmd, arg, result);
 	}
 
 	// using WMI method call
-	if (model == CLEVO_MODEL_V1) {
-		status = clevo_wmi_evaluate_wmbb_method( cmd, arg, result);
-	}
+	if (clevo_backend_is_v1())
+		return clevo_wmi_evaluate_wmbb_method(cmd, arg, result);
 
-	return status;
+	// using ACPI method call, fails with -ENODEV until a device is bound
+	return clevo_acpi_evaluate_method(active_device, cmd, arg, result);
 }
 
-static void set_brightness(u8 brightness)
-{
-	if (kbd_led_state.mode == KB_TYPE_RGB) {
-		if (!clevo_evaluate_method(WMI_SUBMETHOD_ID_SET_KB_LEDS, 0xF4000000 | brightness, NULL))
-		{
-			pr_info("Set rgb brightness to %d\n", brightness);
-			kbd_led_state.brightness = brightness;
-		}
-	}
-	
-	if (kbd_led_state.mode == KB_TYPE_BW) {
-		if (!clevo_evaluate_method(WMI_SUBMETHOD_ID_SET_KB_LEDS_BW, brightness, NULL)) {
-			pr_info("Set brightness to %d\n", brightness);
-			kbd_led_state.brightness = brightness;
-		}
-	}
-}
+#define CLEVO_BACKEND_SAMPLES 5
+
+// probe time backend measurements, U64_MAX = not available
+static struct {
+	u64 wmi_ns;
+	u64 acpi_ns;
+} clevo_backend = {
+	.wmi_ns = U64_MAX,
+	.acpi_ns = U64_MAX,
+};
 
-static int set_color(u32 region, u32 color)
+static ssize_t show_backend_fs(struct device *child,
+			       struct device_attribute *attr, char *buffer)
 {
-	if (kbd_led_state.mode == KB_TYPE_BW && region == REGION_LEFT) {
-		set_brightness(color);
-		return 0;
-	}
-	
-	u32 cset =
-		((color & 0x0000FF) << 16) | ((color & 0xFF0000) >> 8) |
-		((color & 0x00FF00) >> 8);
-	u32 wmi_submethod_arg = region | cset;
+	ssize_t len;
 
-	// pr_info("Set Color '%08x' for region '%08x'", color, region);
+	len = sprintf(buffer, "commands: %s\nevents: %s\n",
+		      clevo_backend_is_v1() ? "wmi" : "acpi",
+		      model == CLEVO_MODEL_V1 ? "wmi" : model == CLEVO_MODEL_V2 ? "acpi" : "none");
+
+	if (clevo_backend.wmi_ns != U64_MAX)
+		len += sprintf(buffer + len, "wmi_ns: %llu\n", clevo_backend.wmi_ns);
+	if (clevo_backend.acpi_ns != U64_MAX)
+		len += sprintf(buffer + len, "acpi_ns: %llu\n", clevo_backend.acpi_ns);
 
-	return clevo_evaluate_method(WMI_SUBMETHOD_ID_SET_KB_LEDS, wmi_submethod_arg, NULL);
+	return len;
 }
 
-static int set_color_code_region(u32 region, u32 colorcode)
-{
+static DEVICE_ATTR(backend, 0444, show_backend_fs, NULL);
 
-	int err;
+// Firmware command scheduler
+//
+// All firmware access goes through a single ordered work item. Commands are
+// queued per class and the highest priority class is always served first, so
+// a burst of background updates never delays a hotkey. A queued write for a
+// state field (slot) is superseded by a newer write to the same field, the
+// merged command moves to the higher priority of the two. A write rejected
+// at the depth limit stays dirty and is committed again once the queues
+// drain.
+//
+// A failed write marks its field dirty again and arms a retry with
+// exponential backoff, which commits the requested state once more. Nobody
+// waits for a retry, the state converges as soon as the firmware answers.
+// A missing backend (-ENODEV, -ENOENT) is not retried.
+
+struct clevo_cmd_t {
+	struct list_head node;
+	u32 submethod;
+	u32 arg;
+	int slot;        /* KBD_DIRTY_* bit number, -1 never merges */
+	u8 cmd_class;
+	u64 seq;         /* oldest request carried by this command */
+	ktime_t queued;
+
+	/* queries only, the command lives on the waiter's stack */
+	struct completion *done;
+	u32 *result;
+	int status;
+};
 
-	if (0 == (err = set_color(region, colorcode)))
-	{
-		// after succesfully setting color, update our state struct
-		// depending on which region was changed
-		switch (region)
-		{
-		case REGION_LEFT:
-			kbd_led_state.color.left = colorcode;
-			break;
-		case REGION_CENTER:
-			kbd_led_state.color.center = colorcode;
-			break;
-		case REGION_RIGHT:
-			kbd_led_state.color.right = colorcode;
-			break;
-		case REGION_EXTRA:
-			kbd_led_state.color.extra = colorcode;
+struct clevo_sched_class_t {
+	struct list_head queue;
+	uint depth;
+	u64 executed;
+	u64 merged;
+	u64 rejected;
+	u64 failed;
+	u64 latency_total_ns;
+	u64 latency_max_ns;
+};
+
+static struct {
+	spinlock_t lock;
+	struct clevo_sched_class_t classes[CLEVO_CMD_CLASSES];
+	struct workqueue_struct *wq;
+	struct work_struct work;
+	wait_queue_head_t idle;
+	u64 next_seq;
+	u64 running_seq;   /* 0 = nothing in flight */
+	u32 failed_fields; /* KBD_DIRTY_* bits of failed writes */
+	bool stopping;
+
+	struct delayed_work resubmit_work;
+	u8 resubmit_class; /* highest class with a rejected write, CLEVO_CMD_CLASSES = none */
+
+	struct delayed_work retry_work;
+	u32 retry_fields;  /* fields failed since the last success */
+	u8 retry_class;    /* highest class among the failed writes */
+	uint retry_attempt;
+	u64 failures;
+	u64 permanent;     /* failures not retried, the backend is missing */
+	u64 retries;
+	u64 recovered;
+} clevo_sched;
+
+static const char * const clevo_cmd_class_names[CLEVO_CMD_CLASSES] = {
+	"hotkey", "resume", "user", "effect"
+};
+
+static struct clevo_cmd_t *clevo_sched_next(void)
+{
+	struct clevo_cmd_t *cmd = NULL;
+	int c;
+
+	spin_lock(&clevo_sched.lock);
+	for (c = 0; c < CLEVO_CMD_CLASSES; c++) {
+		cmd = list_first_entry_or_null(&clevo_sched.classes[c].queue,
+					       struct clevo_cmd_t, node);
+		if (cmd) {
+			list_del(&cmd->node);
+			clevo_sched.classes[c].depth--;
+			clevo_sched.running_seq = cmd->seq;
 			break;
 		}
 	}
-	return err;
+	spin_unlock(&clevo_sched.lock);
+
+	return cmd;
 }
 
-static int set_next_color_whole_kb(void)
+// called with clevo_sched.lock held
+static void clevo_sched_write_failed(struct clevo_cmd_t *cmd, int status)
 {
-	/* "Calculate" new to-be color */
-	u32 new_color_id;
-	u32 new_color_code;
+	u64 delay;
 
-	new_color_id = kbd_led_state.whole_kbd_color + 1;
-	if (new_color_id >= color_list.size)
-	{
-		new_color_id = 0;
+	clevo_sched.failures++;
+	clevo_sched.failed_fields |= BIT(cmd->slot);
+
+	// no backend to talk to, retrying would only wake up forever
+	if (status == -ENODEV || status == -ENOENT) {
+		clevo_sched.permanent++;
+		return;
 	}
-	new_color_code = color_list.colors[new_color_id].code;
 
-	pr_info("set_next_color_whole_kb(): new_color_id: %i, new_color_code %X",
-			new_color_id, new_color_code);
+	if (!clevo_sched.retry_fields)
+		clevo_sched.retry_class = cmd->cmd_class;
+	clevo_sched.retry_fields |= BIT(cmd->slot);
+	clevo_sched.retry_class = min(clevo_sched.retry_class, cmd->cmd_class);
 
-	/* Set color on all four regions*/
-	set_color_code_region(REGION_LEFT, new_color_code);
-	set_color_code_region(REGION_CENTER, new_color_code);
-	set_color_code_region(REGION_RIGHT, new_color_code);
-	set_color_code_region(REGION_EXTRA, new_color_code);
+	if (clevo_sched.stopping || delayed_work_pending(&clevo_sched.retry_work))
+		return;
 
-	kbd_led_state.whole_kbd_color = new_color_id;
+	delay = min_t(u64, (u64)param_retry_base_ms << min(clevo_sched.retry_attempt, 16U),
+		      param_retry_max_ms);
+	clevo_sched.retry_attempt++;
 
-	return 0;
+	pr_debug("firmware write failed, retry #%u in %llums\n",
+		 clevo_sched.retry_attempt, delay);
+
+	queue_delayed_work(system_wq, &clevo_sched.retry_work, msecs_to_jiffies(delay));
 }
 
-static void set_blinking_pattern(u8 blinkling_pattern)
+// called with clevo_sched.lock held
+static void clevo_sched_write_done(struct clevo_cmd_t *cmd)
 {
-	pr_info("set_mode on %s", blinking_patterns[blinkling_pattern].name);
-
-	if (!clevo_evaluate_method(WMI_SUBMETHOD_ID_SET_KB_LEDS, blinking_patterns[blinkling_pattern].value, NULL)) {
-		// method was succesfull so update ur internal state struct
-		kbd_led_state.blinking_pattern = blinkling_pattern;
-	}
+	if (!(clevo_sched.retry_fields & BIT(cmd->slot)))
+		return;
 
-	if (blinkling_pattern == 0) {  // 0 is the "custom" blinking pattern
+	clevo_sched.recovered++;
+	clevo_sched.retry_fields &= ~BIT(cmd->slot);
+	if (!clevo_sched.retry_fields)
+		clevo_sched.retry_attempt = 0;
+}
 
-		// so just set all regions to the stored colors
-		set_color(REGION_LEFT, kbd_led_state.color.left);
-		set_color(REGION_CENTER, kbd_led_state.color.center);
-		set_color(REGION_RIGHT, kbd_led_state.color.right);
+// fields that turned out to be in place although their write failed
+static void clevo_sched_retry_resolved(u32 fields)
+{
+	spin_lock(&clevo_sched.lock);
+	fields &= clevo_sched.retry_fields;
+	clevo_sched.recovered += hweight32(fields);
+	clevo_sched.retry_fields &= ~fields;
+	if (!clevo_sched.retry_fields)
+		clevo_sched.retry_attempt = 0;
+	spin_unlock(&clevo_sched.lock);
+}
 
-		if (kbd_led_state.has_extra == 1) {
-			set_color(REGION_EXTRA, kbd_led_state.color.extra);
-		}
-	}
+static void clevo_sched_retry_work_fn(struct work_struct *work)
+{
+	u8 cmd_class;
+
+	spin_lock(&clevo_sched.lock);
+	clevo_sched.retries++;
+	cmd_class = clevo_sched.retry_class;
+	spin_unlock(&clevo_sched.lock);
+
+	mutex_lock(&kbd_lock);
+	// a failed call may still have reached the EC, only rewrite what differs
+	clevo_keyboard_reconcile(cmd_class, false);
+	clevo_keyboard_commit(cmd_class);
+	mutex_unlock(&kbd_lock);
 }
 
-static int set_enabled_cmd(u8 state)
+static void clevo_sched_resubmit_work_fn(struct work_struct *work)
 {
-	u32 cmd = 0xE0000000;
-	pr_info("Set keyboard enabled to: %d\n", state);
-	// pr_info("Has_extra: %d; Enabled %d; Brightness: %d; Blinking Pattern: %d; whole_kbd_color: %d;", kbd_led_state.has_extra, kbd_led_state.enabled, kbd_led_state.brightness, kbd_led_state.blinking_pattern, kbd_led_state.whole_kbd_color);
+	u8 cmd_class;
 
-	if (state == 0)
-	{
-		cmd |= 0x003001;
-	}
-	else
-	{
-		cmd |= 0x07F001;
-	}
+	spin_lock(&clevo_sched.lock);
+	cmd_class = clevo_sched.resubmit_class;
+	clevo_sched.resubmit_class = CLEVO_CMD_CLASSES;
+	spin_unlock(&clevo_sched.lock);
+
+	if (cmd_class == CLEVO_CMD_CLASSES)
+		return;
 
-	return clevo_evaluate_method(WMI_SUBMETHOD_ID_SET_KB_LEDS, cmd, NULL);
+	// the rejected fields are still dirty
+	mutex_lock(&kbd_lock);
+	clevo_keyboard_commit(cmd_class);
+	mutex_unlock(&kbd_lock);
 }
 
-static void set_enabled(u8 state)
+// called with clevo_sched.lock held
+static void clevo_sched_resubmit_arm(unsigned long delay)
 {
-	if (!set_enabled_cmd(state))
-	{
-		kbd_led_state.enabled = state;
-	}
+	if (clevo_sched.stopping || clevo_sched.resubmit_class == CLEVO_CMD_CLASSES)
+		return;
+
+	queue_delayed_work(system_wq, &clevo_sched.resubmit_work, delay);
 }
 
-void clevo_keyboard_event_callb(u32 event)
+static void clevo_sched_work_fn(struct work_struct *work)
 {
-	//u32 key_event;
+	struct clevo_sched_class_t *cls;
+	struct clevo_cmd_t *cmd;
+	u32 result = 0;
+	u64 latency;
+	int status;
+
+	while ((cmd = clevo_sched_next()) != NULL) {
+		status = clevo_evaluate_method(cmd->submethod, cmd->arg, &result);
+		latency = ktime_to_ns(ktime_sub(ktime_get(), cmd->queued));
+
+		spin_lock(&clevo_sched.lock);
+		cls = &clevo_sched.classes[cmd->cmd_class];
+		cls->executed++;
+		cls->latency_total_ns += latency;
+		cls->latency_max_ns = max(cls->latency_max_ns, latency);
+		if (status) {
+			cls->failed++;
+			if (cmd->slot >= 0)
+				clevo_sched_write_failed(cmd, status);
+		}
+		else if (cmd->slot >= 0) {
+			clevo_sched_write_done(cmd);
+		}
+		clevo_sched.running_seq = 0;
+		spin_unlock(&clevo_sched.lock);
+
+		if (cmd->done) {
+			if (cmd->result)
+				*cmd->result = result;
+			cmd->status = status;
+			complete(cmd->done);
+		}
+		else {
+			kfree(cmd);
+		}
 
-	pr_debug("event callback: (%0#10x)\n", event);
+		wake_up_all(&clevo_sched.idle);
+	}
 
-	//clevo_evaluate_method(0x01, 0, &key_event);
+	// the queues are empty, there is room for what was rejected
+	spin_lock(&clevo_sched.lock);
+	clevo_sched_resubmit_arm(0);
+	spin_unlock(&clevo_sched.lock);
+}
 
-	//pr_info("event catched: (%0#6x)\n", key_event);
+// moves a queued command to a higher class, in seq order among the commands there
+static void clevo_sched_promote(struct clevo_cmd_t *cmd, u8 cmd_class)
+{
+	struct list_head *queue = &clevo_sched.classes[cmd_class].queue;
+	struct clevo_cmd_t *pos;
 
-	switch (event)
-	{
-	case EVENT_CODE_DECREASE_BACKLIGHT_2:
-	case EVENT_CODE_DECREASE_BACKLIGHT:
-		if (kbd_led_state.mode == KB_TYPE_RGB) {
-			if (kbd_led_state.brightness == BRIGHTNESS_MIN || (kbd_led_state.brightness - 25) < BRIGHTNESS_MIN) {
-				set_brightness(BRIGHTNESS_MIN);
-			}
-			else {
-				set_brightness(kbd_led_state.brightness - 25);
-			}
+	clevo_sched.classes[cmd->cmd_class].depth--;
+	clevo_sched.classes[cmd_class].depth++;
+	cmd->cmd_class = cmd_class;
+
+	list_for_each_entry(pos, queue, node) {
+		if (pos->seq > cmd->seq) {
+			list_move_tail(&cmd->node, &pos->node);
+			return;
 		}
+	}
+	list_move_tail(&cmd->node, queue);
+}
 
-		if (kbd_led_state.mode == KB_TYPE_BW) {
-			
-			if (kbd_led_state.brightness > BRIGHTNESS_MIN) {
-				kbd_led_state.brightness--;
-			}
-			set_brightness(kbd_led_state.brightness );
+/*
+ * Queues a state write without waiting for it. Returns -EBUSY when the class
+ * is at its depth limit and -ENOMEM without memory; the caller keeps the
+ * field dirty and it is committed again once the queues drain, or after
+ * retry_base_ms for -ENOMEM.
+ */
+static int clevo_sched_submit(u8 cmd_class, u32 submethod, u32 arg, int slot)
+{
+	struct clevo_cmd_t *cmd, *pos;
+	struct clevo_sched_class_t *cls = &clevo_sched.classes[cmd_class];
+	int c;
+
+	cmd = kzalloc(sizeof(*cmd), GFP_KERNEL);
+	if (!cmd) {
+		spin_lock(&clevo_sched.lock);
+		clevo_sched.resubmit_class = min(clevo_sched.resubmit_class, cmd_class);
+		clevo_sched_resubmit_arm(msecs_to_jiffies(param_retry_base_ms));
+		spin_unlock(&clevo_sched.lock);
+
+		return -ENOMEM;
+	}
 
+	cmd->submethod = submethod;
+	cmd->arg = arg;
+	cmd->slot = slot;
+	cmd->cmd_class = cmd_class;
+	cmd->queued = ktime_get();
+
+	spin_lock(&clevo_sched.lock);
+
+	for (c = 0; slot >= 0 && c < CLEVO_CMD_CLASSES; c++) {
+		list_for_each_entry(pos, &clevo_sched.classes[c].queue, node) {
+			if (pos->slot != slot)
+				continue;
+
+			// supersede in place: keep the oldest seq so barriers still wait
+			// for it, and its place so the commit order holds
+			pos->submethod = submethod;
+			pos->arg = arg;
+			if (cmd_class < c)
+				clevo_sched_promote(pos, cmd_class);
+			cls->merged++;
+			spin_unlock(&clevo_sched.lock);
+
+			kfree(cmd);
+			return 0;
 		}
-		break;
-	case EVENT_CODE_INCREASE_BACKLIGHT_2:
-	case EVENT_CODE_INCREASE_BACKLIGHT:
-		if (kbd_led_state.mode == KB_TYPE_RGB) {
-			if (kbd_led_state.brightness == BRIGHTNESS_MAX || (kbd_led_state.brightness + 25) > BRIGHTNESS_MAX) {
-				set_brightness(BRIGHTNESS_MAX);
-			}
-			else {
-				set_brightness(kbd_led_state.brightness + 25);
+	}
+
+	if (cls->depth >= param_sched_depth[cmd_class]) {
+		cls->rejected++;
+		// armed by the worker when it runs dry
+		clevo_sched.resubmit_class = min(clevo_sched.resubmit_class, cmd_class);
+		spin_unlock(&clevo_sched.lock);
+
+		kfree(cmd);
+		return -EBUSY;
+	}
+
+	cmd->seq = clevo_sched.next_seq++;
+	list_add_tail(&cmd->node, &cls->queue);
+	cls->depth++;
+
+	spin_unlock(&clevo_sched.lock);
+
+	queue_work(clevo_sched.wq, &clevo_sched.work);
+
+	return 0;
+}
+
+// Runs a command that returns a value and waits for its result
+static int clevo_sched_query(u8 cmd_class, u32 submethod, u32 arg, u32 *result)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct clevo_cmd_t cmd = {
+		.submethod = submethod,
+		.arg = arg,
+		.slot = -1,
+		.cmd_class = cmd_class,
+		.done = &done,
+		.result = result,
+	};
+
+	cmd.queued = ktime_get();
+
+	spin_lock(&clevo_sched.lock);
+	cmd.seq = clevo_sched.next_seq++;
+	list_add_tail(&cmd.node, &clevo_sched.classes[cmd_class].queue);
+	clevo_sched.classes[cmd_class].depth++;
+	spin_unlock(&clevo_sched.lock);
+
+	queue_work(clevo_sched.wq, &clevo_sched.work);
+	wait_for_completion(&done);
+
+	return cmd.status;
+}
+
+static bool clevo_sched_done(u64 seq)
+{
+	struct clevo_cmd_t *pos;
+	bool done = true;
+	int c;
+
+	spin_lock(&clevo_sched.lock);
+	if (clevo_sched.running_seq && clevo_sched.running_seq <= seq)
+		done = false;
+
+	for (c = 0; done && c < CLEVO_CMD_CLASSES; c++) {
+		list_for_each_entry(pos, &clevo_sched.classes[c].queue, node) {
+			if (pos->seq <= seq) {
+				done = false;
+				break;
 			}
 		}
-		
-		if (kbd_led_state.mode == KB_TYPE_BW) {
-		
-			kbd_led_state.brightness++;
-			if (kbd_led_state.brightness > BRIGHTNESS_MAX_BW) {
-				kbd_led_state.brightness = BRIGHTNESS_MAX_BW;
+	}
+	spin_unlock(&clevo_sched.lock);
+
+	return done;
+}
+
+// Waits until everything queued so far has reached the firmware
+static void clevo_sched_sync(void)
+{
+	u64 seq;
+
+	spin_lock(&clevo_sched.lock);
+	seq = clevo_sched.next_seq - 1;
+	spin_unlock(&clevo_sched.lock);
+
+	wait_event(clevo_sched.idle, clevo_sched_done(seq));
+}
+
+static u32 clevo_sched_take_failed(void)
+{
+	u32 fields;
+
+	spin_lock(&clevo_sched.lock);
+	fields = clevo_sched.failed_fields;
+	clevo_sched.failed_fields = 0;
+	spin_unlock(&clevo_sched.lock);
+
+	return fields;
+}
+
+static ssize_t show_sched_stats_fs(struct device *child,
+				   struct device_attribute *attr, char *buffer)
+{
+	struct clevo_sched_class_t *cls;
+	ssize_t len = 0;
+	int c;
+
+	spin_lock(&clevo_sched.lock);
+	for (c = 0; c < CLEVO_CMD_CLASSES; c++) {
+		cls = &clevo_sched.classes[c];
+		len += sprintf(buffer + len,
+			       "%s: queued %u executed %llu merged %llu rejected %llu failed %llu "
+			       "latency_avg_us %llu latency_max_us %llu\n",
+			       clevo_cmd_class_names[c], cls->depth, cls->executed,
+			       cls->merged, cls->rejected, cls->failed,
+			       cls->executed ? div64_u64(cls->latency_total_ns, cls->executed) / NSEC_PER_USEC : 0,
+			       cls->latency_max_ns / NSEC_PER_USEC);
+	}
+	spin_unlock(&clevo_sched.lock);
+
+	return len;
+}
+
+static ssize_t show_retry_stats_fs(struct device *child,
+				   struct device_attribute *attr, char *buffer)
+{
+	ssize_t len;
+
+	spin_lock(&clevo_sched.lock);
+	len = sprintf(buffer, "failures: %llu\nnot_retried: %llu\nretries: %llu\nrecovered: %llu\n"
+		      "attempt: %u\npending_fields: %#x\n",
+		      clevo_sched.failures, clevo_sched.permanent, clevo_sched.retries, clevo_sched.recovered,
+		      clevo_sched.retry_attempt, clevo_sched.retry_fields);
+	spin_unlock(&clevo_sched.lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(sched_stats, 0444, show_sched_stats_fs, NULL);
+static DEVICE_ATTR(retry_stats, 0444, show_retry_stats_fs, NULL);
+
+static int clevo_sched_init(void)
+{
+	int c;
+
+	spin_lock_init(&clevo_sched.lock);
+	init_waitqueue_head(&clevo_sched.idle);
+	INIT_WORK(&clevo_sched.work, clevo_sched_work_fn);
+	INIT_DELAYED_WORK(&clevo_sched.retry_work, clevo_sched_retry_work_fn);
+	INIT_DELAYED_WORK(&clevo_sched.resubmit_work, clevo_sched_resubmit_work_fn);
+	clevo_sched.resubmit_class = CLEVO_CMD_CLASSES;
+	clevo_sched.next_seq = 1;
+
+	for (c = 0; c < CLEVO_CMD_CLASSES; c++)
+		INIT_LIST_HEAD(&clevo_sched.classes[c].queue);
+
+	clevo_sched.wq = alloc_ordered_workqueue(KBUILD_MODNAME, WQ_HIGHPRI);
+	if (!clevo_sched.wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void clevo_sched_exit(void)
+{
+	spin_lock(&clevo_sched.lock);
+	clevo_sched.stopping = true;
+	spin_unlock(&clevo_sched.lock);
+
+	cancel_delayed_work_sync(&clevo_sched.retry_work);
+	cancel_delayed_work_sync(&clevo_sched.resubmit_work);
+
+	// the worker drains the queues before the workqueue goes away
+	destroy_workqueue(clevo_sched.wq);
+}
+
+static u32 *kbd_zone_color(int zone)
+{
+	switch (zone) {
+	case ZONE_LEFT:
+		return &kbd_led_state.color.left;
+	case ZONE_CENTER:
+		return &kbd_led_state.color.center;
+	case ZONE_RIGHT:
+		return &kbd_led_state.color.right;
+	default:
+		return &kbd_led_state.color.extra;
+	}
+}
+
+static int region_zone(u32 region)
+{
+	int zone;
+
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		if (zone_regions[zone] == region)
+			return zone;
+	}
+
+	return -EINVAL;
+}
+
+// firmware commands, these do not touch kbd_led_state
+
+static int set_brightness_cmd(u8 cmd_class, u8 brightness)
+{
+	int err;
+
+	if (clevo_kbd_is_rgb()) {
+		err = clevo_sched_submit(cmd_class, WMI_SUBMETHOD_ID_SET_KB_LEDS, 0xF4000000 | brightness,
+					 ilog2(KBD_DIRTY_BRIGHTNESS));
+		if (!err)
+			pr_debug("Set rgb brightness to %d\n", brightness);
+	}
+	else {
+		err = clevo_sched_submit(cmd_class, WMI_SUBMETHOD_ID_SET_KB_LEDS_BW, brightness,
+					 ilog2(KBD_DIRTY_BRIGHTNESS));
+		if (!err)
+			pr_debug("Set brightness to %d\n", brightness);
+	}
+
+	return err;
+}
+
+static int set_color(u8 cmd_class, int zone, u32 color)
+{
+	u32 region = zone_regions[zone];
+	u32 cset =
+		((color & 0x0000FF) << 16) | ((color & 0xFF0000) >> 8) |
+		((color & 0x00FF00) >> 8);
+	u32 wmi_submethod_arg = region | cset;
+
+	// pr_info("Set Color '%08x' for region '%08x'", color, region);
+
+	return clevo_sched_submit(cmd_class, WMI_SUBMETHOD_ID_SET_KB_LEDS, wmi_submethod_arg,
+				  ilog2(KBD_DIRTY_ZONE(zone)));
+}
+
+static int set_blinking_pattern_cmd(u8 cmd_class, u8 blinking_pattern)
+{
+	pr_debug("set_mode on %s\n", blinking_patterns[blinking_pattern].name);
+
+	return clevo_sched_submit(cmd_class, WMI_SUBMETHOD_ID_SET_KB_LEDS,
+				  blinking_patterns[blinking_pattern].value,
+				  ilog2(KBD_DIRTY_PATTERN));
+}
+
+static int set_enabled_cmd(u8 cmd_class, u8 state)
+{
+	u32 cmd = 0xE0000000;
+	pr_debug("Set keyboard enabled to: %d\n", state);
+	// pr_info("Has_extra: %d; Enabled %d; Brightness: %d; Blinking Pattern: %d; whole_kbd_color: %d;", kbd_led_state.has_extra, kbd_led_state.enabled, kbd_led_state.brightness, kbd_led_state.blinking_pattern, kbd_led_state.whole_kbd_color);
+
+	if (state == 0)
+	{
+		cmd |= 0x003001;
+	}
+	else
+	{
+		cmd |= 0x07F001;
+	}
+
+	return clevo_sched_submit(cmd_class, WMI_SUBMETHOD_ID_SET_KB_LEDS, cmd,
+				  ilog2(KBD_DIRTY_ENABLED));
+}
+
+// state commit
+
+// what the firmware should show, lid and blank override the requested state
+static bool clevo_keyboard_shown_enabled(void)
+{
+	return kbd_led_state.enabled && !kbd_forced_off;
+}
+
+/*
+ * Brightness fade on RGB keyboards. kbd_led_state.brightness is always the
+ * requested level, while a fade runs the firmware is shown kbd_fade.level.
+ */
+static struct {
+	bool active;
+	bool disable; /* switch the backlight off when the fade ends */
+	u8 from;
+	u8 to;
+	u8 level;
+	ktime_t start;
+} kbd_fade;
+
+static u8 clevo_keyboard_shown_brightness(void)
+{
+	return kbd_fade.active ? kbd_fade.level : kbd_led_state.brightness;
+}
+
+static u32 clevo_keyboard_deferred_mask(void)
+{
+	if (kbd_suspended)
+		return KBD_DIRTY_ALL;
+
+	// with the backlight off only the enabled field is visible
+	if (!clevo_keyboard_shown_enabled())
+		return KBD_DIRTY_ALL & ~KBD_DIRTY_ENABLED;
+
+	return 0;
+}
+
+static void clevo_keyboard_mark_dirty(u32 fields)
+{
+	u32 held = fields & clevo_keyboard_deferred_mask();
+
+	kbd_defer_stats.deferred += hweight32(held);
+	kbd_deferred |= held;
+	kbd_dirty |= fields;
+}
+
+// a direct write wins over a running fade
+static void clevo_fade_cancel(void)
+{
+	if (!kbd_fade.active)
+		return;
+
+	kbd_fade.active = false;
+	kbd_fade.disable = false;
+	clevo_keyboard_mark_dirty(KBD_DIRTY_BRIGHTNESS);
+}
+
+// Layer compositor
+//
+// The zone colors in kbd_led_state are the base. Named layers are blended
+// on top of it in priority order, each with its own color and alpha per
+// zone and an optional expiry. kbd_composed holds what the firmware should
+// show, and only zones whose composed color changes are marked dirty.
+
+#define KBD_LAYERS_MAX 8
+#define KBD_LAYER_NAME_LEN 16
+
+struct kbd_layer_t {
+	struct list_head node;
+	char name[KBD_LAYER_NAME_LEN];
+	int priority;
+	u32 zones; /* KBD_DIRTY_ZONE() bits this layer covers */
+	u32 color[ZONE_COUNT];
+	u8 alpha[ZONE_COUNT];
+	unsigned long expires; /* jiffies, 0 = never */
+};
+
+static LIST_HEAD(kbd_layers); /* by ascending priority, under kbd_lock */
+static uint kbd_layer_count;
+static u32 kbd_composed[ZONE_COUNT];
+static u8 kbd_reactive_alpha[ZONE_COUNT]; /* typing reaction, above all layers */
+
+static void clevo_layers_expire_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(kbd_layers_work, clevo_layers_expire_fn);
+
+static u32 clevo_blend(u32 below, u32 above, u8 alpha)
+{
+	u32 out = 0;
+	int shift;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		u32 b = (below >> shift) & 0xFF;
+		u32 a = (above >> shift) & 0xFF;
+
+		out |= ((b * (255 - alpha) + a * alpha + 127) / 255) << shift;
+	}
+
+	return out;
+}
+
+// recomputes the given zones and marks those whose output changed
+static void clevo_compositor_update(u32 zones)
+{
+	struct kbd_layer_t *layer;
+	u32 color;
+	int zone;
+
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		if (!(zones & KBD_DIRTY_ZONE(zone)))
+			continue;
+
+		color = *kbd_zone_color(zone);
+		list_for_each_entry(layer, &kbd_layers, node) {
+			if (layer->zones & KBD_DIRTY_ZONE(zone))
+				color = clevo_blend(color, layer->color[zone], layer->alpha[zone]);
+		}
+
+		if (kbd_reactive_alpha[zone])
+			color = clevo_blend(color, param_reactive_color, kbd_reactive_alpha[zone]);
+
+		if (color != kbd_composed[zone]) {
+			kbd_composed[zone] = color;
+			clevo_keyboard_mark_dirty(KBD_DIRTY_ZONE(zone));
+		}
+	}
+}
+
+static struct kbd_layer_t *clevo_layer_find(const char *name)
+{
+	struct kbd_layer_t *layer;
+
+	list_for_each_entry(layer, &kbd_layers, node) {
+		if (!strcmp(layer->name, name))
+			return layer;
+	}
+
+	return NULL;
+}
+
+// both return the zones the caller has to recompose
+static u32 clevo_layer_remove(struct kbd_layer_t *layer)
+{
+	u32 zones = layer->zones;
+
+	list_del(&layer->node);
+	kbd_layer_count--;
+	kfree(layer);
+
+	return zones;
+}
+
+static u32 clevo_layer_insert(struct kbd_layer_t *layer)
+{
+	struct kbd_layer_t *pos;
+
+	list_for_each_entry(pos, &kbd_layers, node) {
+		if (pos->priority > layer->priority)
+			break;
+	}
+	list_add_tail(&layer->node, &pos->node);
+	kbd_layer_count++;
+
+	return layer->zones;
+}
+
+// drops expired layers and arms the work for the next expiry
+static void clevo_layers_expire(void)
+{
+	struct kbd_layer_t *layer, *tmp;
+	unsigned long next = 0;
+	u32 zones = 0;
+
+	list_for_each_entry_safe(layer, tmp, &kbd_layers, node) {
+		if (!layer->expires)
+			continue;
+
+		if (time_after_eq(jiffies, layer->expires)) {
+			zones |= clevo_layer_remove(layer);
+			continue;
+		}
+
+		if (!next || time_before(layer->expires, next))
+			next = layer->expires;
+	}
+
+	clevo_compositor_update(zones);
+
+	if (next)
+		mod_delayed_work(system_wq, &kbd_layers_work,
+				 time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+static void clevo_layers_expire_fn(struct work_struct *work)
+{
+	mutex_lock(&kbd_lock);
+	clevo_layers_expire();
+	clevo_keyboard_commit(CLEVO_CMD_EFFECT);
+	mutex_unlock(&kbd_lock);
+}
+
+static void clevo_layers_exit(void)
+{
+	struct kbd_layer_t *layer, *tmp;
+
+	cancel_delayed_work_sync(&kbd_layers_work);
+
+	list_for_each_entry_safe(layer, tmp, &kbd_layers, node) {
+		list_del(&layer->node);
+		kfree(layer);
+	}
+	kbd_layer_count = 0;
+}
+
+static ssize_t show_layers_fs(struct device *child,
+			      struct device_attribute *attr, char *buffer)
+{
+	static const char * const zone_names[ZONE_COUNT] = {
+		"left", "center", "right", "extra"
+	};
+	struct kbd_layer_t *layer;
+	ssize_t len = 0;
+	int zone;
+
+	mutex_lock(&kbd_lock);
+	list_for_each_entry(layer, &kbd_layers, node) {
+		len += sprintf(buffer + len, "%s priority=%d", layer->name, layer->priority);
+		for (zone = 0; zone < ZONE_COUNT; zone++) {
+			if (layer->zones & KBD_DIRTY_ZONE(zone))
+				len += sprintf(buffer + len, " %s=%06x/%02x", zone_names[zone],
+					       layer->color[zone], layer->alpha[zone]);
+		}
+		if (layer->expires)
+			len += sprintf(buffer + len, " ttl=%u",
+				       jiffies_to_msecs(max_t(long, layer->expires - jiffies, 0)));
+		len += sprintf(buffer + len, "\n");
+	}
+	mutex_unlock(&kbd_lock);
+
+	return len;
+}
+
+// parses RRGGBB or RRGGBB/AA
+static int clevo_layer_parse_color(char *value, u32 *color, u8 *alpha)
+{
+	char *alpha_str = strchr(value, '/');
+	unsigned int num;
+	int err;
+
+	*alpha = 0xFF;
+	if (alpha_str) {
+		*alpha_str++ = '\0';
+		err = kstrtouint(alpha_str, 16, &num);
+		if (err)
+			return err;
+		if (num > 0xFF)
+			return -EINVAL;
+		*alpha = num;
+	}
+
+	err = kstrtouint(value, 16, &num);
+	if (err)
+		return err;
+	if (num > 0xFFFFFF)
+		return -EINVAL;
+	*color = num;
+
+	return 0;
+}
+
+/*
+ * "<name> [priority=N] [ttl=MS] [left|center|right|extra|all=RRGGBB[/AA]]..."
+ * adds or replaces a layer, "-<name>" removes it.
+ */
+static ssize_t set_layers_fs(struct device *child, struct device_attribute *attr,
+			     const char *buffer, size_t size)
+{
+	static const char * const zone_keys[ZONE_COUNT] = {
+		"left", "center", "right", "extra"
+	};
+	struct kbd_layer_t *layer = NULL, *old;
+	char *buf, *cursor, *name, *token, *value;
+	unsigned int ttl = 0;
+	ssize_t err = -EINVAL;
+	u32 zones, color;
+	bool wait;
+	u8 alpha;
+	int zone;
+
+	if (!clevo_kbd_is_rgb())
+		return -EOPNOTSUPP;
+
+	buf = kstrndup(buffer, size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cursor = strim(buf);
+	name = strsep(&cursor, " \t");
+
+	if (name[0] == '-') {
+		name++;
+		goto apply;
+	}
+
+	if (!*name || strlen(name) >= KBD_LAYER_NAME_LEN)
+		goto out;
+
+	layer = kzalloc(sizeof(*layer), GFP_KERNEL);
+	if (!layer) {
+		err = -ENOMEM;
+		goto out;
+	}
+	strscpy(layer->name, name, sizeof(layer->name));
+
+	while ((token = strsep(&cursor, " \t")) != NULL) {
+		if (!*token)
+			continue;
+
+		value = strchr(token, '=');
+		if (!value)
+			goto out;
+		*value++ = '\0';
+
+		if (!strcmp(token, "priority")) {
+			if (kstrtoint(value, 0, &layer->priority))
+				goto out;
+			continue;
+		}
+
+		if (!strcmp(token, "ttl")) {
+			if (kstrtouint(value, 0, &ttl))
+				goto out;
+			continue;
+		}
+
+		zones = 0;
+		for (zone = 0; zone < ZONE_COUNT; zone++) {
+			if (!strcmp(token, "all") || !strcmp(token, zone_keys[zone]))
+				zones |= KBD_DIRTY_ZONE(zone);
+		}
+
+		if (!zones || clevo_layer_parse_color(value, &color, &alpha))
+			goto out;
+
+		for (zone = 0; zone < ZONE_COUNT; zone++) {
+			if (zones & KBD_DIRTY_ZONE(zone)) {
+				layer->color[zone] = color;
+				layer->alpha[zone] = alpha;
 			}
-			set_brightness(kbd_led_state.brightness);
 		}
-		break;
+		layer->zones |= zones;
+	}
+
+	// 0 means no expiry, so never end up there through a wrap
+	if (ttl)
+		layer->expires = (jiffies + msecs_to_jiffies(ttl)) ? : 1;
+
+apply:
+	err = clevo_lease_lock(NULL);
+	if (err)
+		goto out;
+
+	zones = 0;
+	old = clevo_layer_find(name);
+	if (old)
+		zones |= clevo_layer_remove(old);
+	else if (!layer)
+		err = -ENOENT;
+
+	if (layer && kbd_layer_count >= KBD_LAYERS_MAX) {
+		err = -ENOSPC;
+	}
+	else if (layer) {
+		zones |= clevo_layer_insert(layer);
+		layer = NULL;
+	}
+
+	// a replaced layer only rewrites the zones that actually changed
+	clevo_compositor_update(zones);
+	clevo_layers_expire();
+	wait = clevo_keyboard_commit_user();
+
+	mutex_unlock(&kbd_lock);
+
+	if (wait)
+		clevo_sched_sync();
+
+	if (!err)
+		err = size;
+out:
+	kfree(layer);
+	kfree(buf);
+	return err;
+}
+
+static DEVICE_ATTR(layers, 0644, show_layers_fs, set_layers_fs);
+
+static u32 clevo_keyboard_commit_zones(u8 cmd_class, u32 dirty)
+{
+	u32 done = 0;
+	int zone;
+
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		if (!(dirty & KBD_DIRTY_ZONE(zone)))
+			continue;
+
+		if (zone == ZONE_EXTRA && kbd_led_state.has_extra != 1) {
+			done |= KBD_DIRTY_ZONE(zone);
+			continue;
+		}
+
+		if (!set_color(cmd_class, zone, kbd_composed[zone]))
+			done |= KBD_DIRTY_ZONE(zone);
+	}
+
+	return done;
+}
+
+// Residency and energy
+//
+// Every commit closes the interval the previous shown state was on screen
+// and starts a new one, so the cost is a handful of additions per commit.
+
+#define KBD_RESIDENCY_BUCKETS 5
+
+/*
+ * Backlight power at full brightness, all zones white. No model has been
+ * measured; these are rough guesses per keyboard type, so energy figures are
+ * only comparable between runs on the same machine unless power_mw is set.
+ */
+static const u32 kbd_power_default_mw[] = {
+	[KB_TYPE_BW] = 500,
+	[KB_TYPE_RGB] = 1500,
+};
+
+static struct {
+	ktime_t since;       /* start of the current interval, 0 = not started */
+	bool on;
+	u8 bucket;
+	u8 pattern;
+	u32 power_mw;        /* estimate for the current interval */
+	u64 on_ns;
+	u64 off_ns;
+	u64 bucket_ns[KBD_RESIDENCY_BUCKETS];
+	u64 pattern_ns[ARRAY_SIZE(blinking_patterns)];
+	u64 energy_uj;
+} kbd_residency;
+
+static u32 clevo_residency_full_mw(void)
+{
+	return param_power_mw ? : kbd_power_default_mw[clevo_kbd_is_rgb() ? KB_TYPE_RGB : KB_TYPE_BW];
+}
+
+static u32 clevo_residency_power_mw(void)
+{
+	u32 max = clevo_kbd_is_rgb() ? BRIGHTNESS_MAX : BRIGHTNESS_MAX_BW;
+	u64 power = clevo_residency_full_mw();
+	u32 level = 0;
+	int zone, zones = 0;
+
+	if (!kbd_residency.on)
+		return 0;
+
+	power = power * clevo_keyboard_shown_brightness() / max;
+
+	if (!clevo_kbd_is_rgb())
+		return power;
+
+	// firmware effects animate the colors, count them at half
+	if (kbd_led_state.blinking_pattern != 0)
+		return power / 2;
+
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		if (zone == ZONE_EXTRA && kbd_led_state.has_extra != 1)
+			continue;
+		level += (kbd_composed[zone] & 0xFF) + ((kbd_composed[zone] >> 8) & 0xFF) +
+			 ((kbd_composed[zone] >> 16) & 0xFF);
+		zones++;
+	}
+
+	return div_u64(power * level, zones * 3 * 255);
+}
+
+// closes the running interval, called with kbd_lock held
+static void clevo_residency_close(ktime_t now)
+{
+	u64 delta;
+
+	if (!kbd_residency.since)
+		return;
+
+	delta = ktime_to_ns(ktime_sub(now, kbd_residency.since));
+
+	if (kbd_residency.on) {
+		kbd_residency.on_ns += delta;
+		kbd_residency.bucket_ns[kbd_residency.bucket] += delta;
+		kbd_residency.pattern_ns[kbd_residency.pattern] += delta;
+		kbd_residency.energy_uj += div_u64(delta * kbd_residency.power_mw, NSEC_PER_MSEC);
+	}
+	else {
+		kbd_residency.off_ns += delta;
+	}
+
+	kbd_residency.since = now;
+}
+
+// starts a new interval with the state the firmware was just told to show
+static void clevo_residency_account(void)
+{
+	u32 max = clevo_kbd_is_rgb() ? BRIGHTNESS_MAX : BRIGHTNESS_MAX_BW;
+	ktime_t now = ktime_get();
+
+	clevo_residency_close(now);
+
+	kbd_residency.since = now;
+	kbd_residency.on = clevo_keyboard_shown_enabled() && !kbd_suspended &&
+			   clevo_keyboard_shown_brightness();
+	kbd_residency.bucket = min_t(u32, clevo_keyboard_shown_brightness() * KBD_RESIDENCY_BUCKETS / max,
+				     KBD_RESIDENCY_BUCKETS - 1);
+	kbd_residency.pattern = clevo_kbd_is_rgb() ? kbd_led_state.blinking_pattern : 0;
+	kbd_residency.power_mw = clevo_residency_power_mw();
+}
+
+static ssize_t show_residency_fs(struct device *child,
+				 struct device_attribute *attr, char *buffer)
+{
+	ssize_t len;
+	int i;
+
+	mutex_lock(&kbd_lock);
+
+	clevo_residency_close(ktime_get());
+
+	len = sprintf(buffer, "on_ms: %llu\noff_ms: %llu\n",
+		      div_u64(kbd_residency.on_ns, NSEC_PER_MSEC),
+		      div_u64(kbd_residency.off_ns, NSEC_PER_MSEC));
+
+	for (i = 0; i < KBD_RESIDENCY_BUCKETS; i++)
+		len += sprintf(buffer + len, "brightness_%u-%u%%_ms: %llu\n",
+			       i * 100 / KBD_RESIDENCY_BUCKETS,
+			       (i + 1) * 100 / KBD_RESIDENCY_BUCKETS - 1 + (i == KBD_RESIDENCY_BUCKETS - 1),
+			       div_u64(kbd_residency.bucket_ns[i], NSEC_PER_MSEC));
+
+	for (i = 0; clevo_kbd_is_rgb() && i < ARRAY_SIZE(blinking_patterns); i++)
+		len += sprintf(buffer + len, "pattern_%s_ms: %llu\n", blinking_patterns[i].name,
+			       div_u64(kbd_residency.pattern_ns[i], NSEC_PER_MSEC));
+
+	len += sprintf(buffer + len, "power_mw: %u\nenergy_mj: %llu\n",
+		       kbd_residency.power_mw, div_u64(kbd_residency.energy_uj, 1000));
+
+	mutex_unlock(&kbd_lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(residency, 0444, show_residency_fs, NULL);
+
+/*
+ * Queues every dirty field that is visible right now, in an order that never
+ * shows intermediate colours: pattern, zones, brightness and enabled last.
+ * Fields the scheduler rejected or the firmware failed on stay dirty; the
+ * scheduler commits them again once its queues drain or the retry fires.
+ */
+static void clevo_keyboard_commit(u8 cmd_class)
+{
+	u32 dirty;
+	u32 done = 0;
+
+	kbd_dirty |= clevo_sched_take_failed();
+
+	dirty = kbd_dirty & ~clevo_keyboard_deferred_mask();
+	if (!dirty)
+		return;
+
+	if (!clevo_kbd_is_rgb()) {
+		// single color keyboards are switched off through brightness
+		if (dirty & (KBD_DIRTY_BRIGHTNESS | KBD_DIRTY_ENABLED)) {
+			if (!set_brightness_cmd(cmd_class, clevo_keyboard_shown_enabled() ? kbd_led_state.brightness : 0))
+				done |= KBD_DIRTY_BRIGHTNESS | KBD_DIRTY_ENABLED;
+		}
+
+		// colors and patterns have no firmware counterpart here
+		done |= dirty & (KBD_DIRTY_ZONES | KBD_DIRTY_PATTERN);
+		goto out;
+	}
+
+	if (kbd_led_state.blinking_pattern == 0) {
+		if (dirty & KBD_DIRTY_PATTERN) {
+			if (!set_blinking_pattern_cmd(cmd_class, 0))
+				done |= KBD_DIRTY_PATTERN;
+
+			// the custom pattern shows the stored colors, so write them again
+			dirty |= KBD_DIRTY_ZONES;
+		}
+
+		done |= clevo_keyboard_commit_zones(cmd_class, dirty);
+	}
+	else {
+		// firmware effects animate the zone colors, put them in place first
+		done |= clevo_keyboard_commit_zones(cmd_class, dirty);
+
+		if (dirty & KBD_DIRTY_PATTERN) {
+			if (!set_blinking_pattern_cmd(cmd_class, kbd_led_state.blinking_pattern))
+				done |= KBD_DIRTY_PATTERN;
+		}
+	}
+
+	if (dirty & KBD_DIRTY_BRIGHTNESS) {
+		if (!set_brightness_cmd(cmd_class, clevo_keyboard_shown_brightness()))
+			done |= KBD_DIRTY_BRIGHTNESS;
+	}
+
+	if (dirty & KBD_DIRTY_ENABLED) {
+		if (!set_enabled_cmd(cmd_class, clevo_keyboard_shown_enabled()))
+			done |= KBD_DIRTY_ENABLED;
+	}
+
+out:
+	kbd_defer_stats.flushed += hweight32(done & kbd_deferred);
+	kbd_deferred &= ~done;
+	kbd_dirty &= ~done;
+
+	clevo_residency_account();
+}
+
+// state setters, these update kbd_led_state, the caller commits
+
+static void set_brightness(u8 brightness)
+{
+	clevo_fade_cancel();
+	kbd_led_state.brightness = brightness;
+	clevo_keyboard_mark_dirty(KBD_DIRTY_BRIGHTNESS);
+}
+
+static int set_color_code_region(u32 region, u32 colorcode)
+{
+	int zone = region_zone(region);
+
+	if (zone < 0)
+		return zone;
+
+	*kbd_zone_color(zone) = colorcode;
+	clevo_compositor_update(KBD_DIRTY_ZONE(zone));
+
+	// single color keyboards take the left region as brightness
+	if (!clevo_kbd_is_rgb() && zone == ZONE_LEFT) {
+		kbd_led_state.brightness = min_t(u32, colorcode, BRIGHTNESS_MAX_BW);
+		clevo_keyboard_mark_dirty(KBD_DIRTY_BRIGHTNESS);
+	}
+
+	return 0;
+}
+
+static int set_next_color_whole_kb(void)
+{
+	/* "Calculate" new to-be color */
+	u32 new_color_id;
+	u32 new_color_code;
+
+	new_color_id = kbd_led_state.whole_kbd_color + 1;
+	if (new_color_id >= color_list.size)
+	{
+		new_color_id = 0;
+	}
+	new_color_code = color_list.colors[new_color_id].code;
+
+	pr_info("set_next_color_whole_kb(): new_color_id: %i, new_color_code %X",
+			new_color_id, new_color_code);
+
+	/* Set color on all four regions*/
+	set_color_code_region(REGION_LEFT, new_color_code);
+	set_color_code_region(REGION_CENTER, new_color_code);
+	set_color_code_region(REGION_RIGHT, new_color_code);
+	set_color_code_region(REGION_EXTRA, new_color_code);
+
+	kbd_led_state.whole_kbd_color = new_color_id;
+
+	return 0;
+}
+
+static void set_blinking_pattern(u8 blinkling_pattern)
+{
+	kbd_led_state.blinking_pattern = blinkling_pattern;
+	clevo_keyboard_mark_dirty(KBD_DIRTY_PATTERN);
+}
+
+static void set_enabled(u8 state)
+{
+	clevo_fade_cancel();
+	kbd_led_state.enabled = state;
+	clevo_keyboard_mark_dirty(KBD_DIRTY_ENABLED);
+}
+
+// Brightness fades
+//
+// A fade writes at most fade_steps intermediate levels, the first one right
+// away, and the target after fade_ms. Levels follow the clock, so a late
+// timer skips levels instead of stretching the fade, and a new fade simply
+// replaces the running one.
+
+static void clevo_fade_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(kbd_fade_work, clevo_fade_work_fn);
+
+static u8 clevo_fade_level(uint tick, uint steps)
+{
+	return kbd_fade.from + ((int)kbd_fade.to - kbd_fade.from) * (int)tick / (int)(steps + 1);
+}
+
+// called with kbd_lock held, the caller commits
+static void clevo_fade_start(u8 from, u8 to, bool disable)
+{
+	uint steps = param_fade_steps;
+
+	if (!param_fade_ms || !steps || from == to || !clevo_kbd_is_rgb()) {
+		clevo_fade_cancel();
+		if (disable)
+			set_enabled(0);
+		return;
+	}
+
+	kbd_fade.active = true;
+	kbd_fade.disable = disable;
+	kbd_fade.from = from;
+	kbd_fade.to = to;
+	kbd_fade.start = ktime_get();
+	kbd_fade.level = clevo_fade_level(1, steps);
+	clevo_keyboard_mark_dirty(KBD_DIRTY_BRIGHTNESS);
+
+	mod_delayed_work(system_wq, &kbd_fade_work, msecs_to_jiffies(param_fade_ms / steps));
+}
+
+static void clevo_fade_work_fn(struct work_struct *work)
+{
+	uint steps = max(param_fade_steps, 1U);
+	uint interval = max(param_fade_ms / steps, 1U);
+	uint elapsed, tick;
+	u8 level;
+
+	mutex_lock(&kbd_lock);
+
+	if (!kbd_fade.active)
+		goto out;
+
+	elapsed = ktime_ms_delta(ktime_get(), kbd_fade.start);
+	tick = elapsed / interval + 1;
+
+	if (tick > steps) {
+		kbd_fade.active = false;
+		if (kbd_fade.disable) {
+			kbd_fade.disable = false;
+			set_enabled(0);
+		}
+		clevo_keyboard_mark_dirty(KBD_DIRTY_BRIGHTNESS);
+		clevo_keyboard_commit(CLEVO_CMD_HOTKEY);
+		goto out;
+	}
+
+	level = clevo_fade_level(tick, steps);
+	if (level != kbd_fade.level) {
+		kbd_fade.level = level;
+		clevo_keyboard_mark_dirty(KBD_DIRTY_BRIGHTNESS);
+		clevo_keyboard_commit(CLEVO_CMD_EFFECT);
+	}
+
+	mod_delayed_work(system_wq, &kbd_fade_work,
+			 msecs_to_jiffies(tick * interval - elapsed));
+out:
+	mutex_unlock(&kbd_lock);
+}
+
+// hotkey brightness change, retargets a running fade
+static void clevo_fade_brightness(u8 brightness)
+{
+	u8 from = clevo_keyboard_shown_brightness();
+
+	set_brightness(brightness);
+	if (kbd_led_state.enabled)
+		clevo_fade_start(from, brightness, false);
+}
+
+static void clevo_fade_toggle(void)
+{
+	u8 from = clevo_keyboard_shown_brightness();
+
+	// fade out first and switch off at the end
+	if (kbd_led_state.enabled && !kbd_fade.disable) {
+		clevo_fade_start(from, 0, true);
+		return;
+	}
+
+	// otherwise fade in, possibly from a fade out that was still running
+	if (!kbd_led_state.enabled) {
+		set_enabled(1);
+		from = 0;
+	}
+	clevo_fade_start(from, kbd_led_state.brightness, false);
+}
+
+// single color hotkeys only move brightness, so they also undo a state=0
+static void clevo_keyboard_hotkey_enable_bw(void)
+{
+	if (!kbd_led_state.enabled)
+		set_enabled(1);
+}
+
+void clevo_keyboard_event_callb(u32 event)
+{
+	//u32 key_event;
+
+	pr_debug("event callback: (%0#10x)\n", event);
+
+	//clevo_evaluate_method(0x01, 0, &key_event);
+
+	//pr_info("event catched: (%0#6x)\n", key_event);
+
+	mutex_lock(&kbd_lock);
+
+	switch (event)
+	{
+	case EVENT_CODE_DECREASE_BACKLIGHT_2:
+	case EVENT_CODE_DECREASE_BACKLIGHT:
+		if (clevo_kbd_is_rgb()) {
+			if (kbd_led_state.brightness == BRIGHTNESS_MIN || (kbd_led_state.brightness - BRIGHTNESS_STEP) < BRIGHTNESS_MIN) {
+				clevo_fade_brightness(BRIGHTNESS_MIN);
+			}
+			else {
+				clevo_fade_brightness(kbd_led_state.brightness - BRIGHTNESS_STEP);
+			}
+		}
+
+		if (!clevo_kbd_is_rgb()) {
+			clevo_keyboard_hotkey_enable_bw();
+
+			if (kbd_led_state.brightness > BRIGHTNESS_MIN) {
+				kbd_led_state.brightness--;
+			}
+			set_brightness(kbd_led_state.brightness );
+
+		}
+		break;
+	case EVENT_CODE_INCREASE_BACKLIGHT_2:
+	case EVENT_CODE_INCREASE_BACKLIGHT:
+		if (clevo_kbd_is_rgb()) {
+			if (kbd_led_state.brightness == BRIGHTNESS_MAX || (kbd_led_state.brightness + BRIGHTNESS_STEP) > BRIGHTNESS_MAX) {
+				clevo_fade_brightness(BRIGHTNESS_MAX);
+			}
+			else {
+				clevo_fade_brightness(kbd_led_state.brightness + BRIGHTNESS_STEP);
+			}
+		}
+		
+		if (!clevo_kbd_is_rgb()) {
+			clevo_keyboard_hotkey_enable_bw();
+
+			kbd_led_state.brightness++;
+			if (kbd_led_state.brightness > BRIGHTNESS_MAX_BW) {
+				kbd_led_state.brightness = BRIGHTNESS_MAX_BW;
+			}
+			set_brightness(kbd_led_state.brightness);
+		}
+		break;
+
+	case EVENT_CODE_NEXT_BLINKING_PATTERN:
+		if (clevo_kbd_is_rgb()) {
+			set_next_color_whole_kb();
+		}
+		break;
+
+	case EVENT_CODE_TOGGLE_STATE_2:
+	case EVENT_CODE_TOGGLE_STATE:
+		if (clevo_kbd_is_rgb()) {
+			clevo_fade_toggle();
+		}
+		
+		if (!clevo_kbd_is_rgb()) {
+			if (!kbd_led_state.enabled) {
+				// switched off through state, toggling turns it back on
+				clevo_keyboard_hotkey_enable_bw();
+				set_brightness(kbd_led_state.brightness ?: BRIGHTNESS_MAX_BW);
+			}
+			else {
+				set_brightness(kbd_led_state.brightness == 0 ? BRIGHTNESS_MAX_BW : 0);
+			}
+		}
+		break;
+
+	default:
+		pr_info("unmanaged event: (%0#10x)\n", event);
+		// might be a backlight change handled by the firmware itself, RGB
+		// keyboards cannot read it back and keep the requested state
+		clevo_keyboard_reconcile(CLEVO_CMD_HOTKEY, true);
+		break;
+	}
+
+	clevo_keyboard_commit(CLEVO_CMD_HOTKEY);
+
+	mutex_unlock(&kbd_lock);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+static void clevo_wmi_notify(union acpi_object *obj, void *context)
+{
+	if (!obj)
+		return;
+
+	if (obj->type == ACPI_TYPE_INTEGER) {
+		u32 event;
+		clevo_sched_query(CLEVO_CMD_HOTKEY, WMI_SUBMETHOD_ID_GET_EVENT, 0, &event);
+		clevo_keyboard_event_callb(event);
+	}
+}
+#else
+static void clevo_wmi_notify(u32 value, void *context)
+{
+	u32 event;
+
+	if (value != 0xD0) {
+		pr_info("Unexpected WMI event (%0#6x)\n", value);
+		return;
+	}
+
+	clevo_sched_query(CLEVO_CMD_HOTKEY, WMI_SUBMETHOD_ID_GET_EVENT, 0, &event);
+	clevo_keyboard_event_callb(event);
+}
+#endif
+
+static int clevo_acpi_add(struct acpi_device *device)
+{
+	u32 result;
+
+	pr_info("%s",__PRETTY_FUNCTION__);
+
+	active_device = device;
+
+	// WMI boards bind the device for commands only, their events stay on WMI
+	if (model != CLEVO_MODEL_V2)
+		return 0;
+
+	// This is the get_app method for the keyboard, without it we would not get event notifications.
+	clevo_sched_query(CLEVO_CMD_RESUME, WMI_SUBMETHOD_ID_GET_AP, 0, &result);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+static void clevo_acpi_remove(struct acpi_device *device)
+{
+	pr_info("%s",__PRETTY_FUNCTION__);
+
+}
+#else
+static int clevo_acpi_remove(struct acpi_device *device)
+{
+	pr_info("%s",__PRETTY_FUNCTION__);
+	return 0;
+}
+#endif
+
+void clevo_acpi_notify(struct acpi_device *device, u32 event)
+{
+	 pr_info("ACPI event: %0#10x\n", event);
+
+	// bound for commands only, events come in through WMI
+	if (model == CLEVO_MODEL_V1)
+		return;
+
+	clevo_keyboard_event_callb(event);
+}
+
+static const struct acpi_device_id device_ids[] = {
+	{"CLV0001", 0},
+	{"", 0},
+};
+
+MODULE_DEVICE_TABLE(acpi, device_ids);
+
+static struct acpi_driver clevo_acpi_driver = {
+	.name = "Clevo Keyboard",
+	.class = "Clevo",
+	.ids = device_ids,
+	.flags = ACPI_DRIVER_ALL_NOTIFY_EVENTS,
+	.ops = {
+		.add = clevo_acpi_add,
+		.remove = clevo_acpi_remove,
+		.notify = clevo_acpi_notify,
+	},
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+	.owner = THIS_MODULE,
+#endif	
+};
+
+
+void clevo_keyboard_write_state(void)
+{
+	// Note:
+	// - the custom blinking pattern also writes colors
+	// - fields that are not visible right now stay pending
+	clevo_keyboard_mark_dirty(KBD_DIRTY_PATTERN | KBD_DIRTY_BRIGHTNESS | KBD_DIRTY_ENABLED);
+	clevo_keyboard_commit(CLEVO_CMD_RESUME);
+}
+
+/*
+ * Compares the backlight the firmware shows with kbd_led_state. Matching
+ * fields are no longer dirty, differing ones are either taken over (adopt,
+ * for changes the EC made on its own) or marked dirty for the next commit.
+ * Only single color keyboards have a GET submethod, RGB ones return
+ * -EOPNOTSUPP and callers fall back to writing the full state.
+ * Called with kbd_lock held.
+ */
+static int clevo_keyboard_reconcile(u8 cmd_class, bool adopt)
+{
+	u32 fields = KBD_DIRTY_BRIGHTNESS | KBD_DIRTY_ENABLED;
+	u8 requested;
+	u32 shown;
+	int err;
+
+	if (clevo_kbd_is_rgb())
+		return -EOPNOTSUPP;
+
+	if (kbd_suspended)
+		return -EAGAIN;
+
+	kbd_dirty |= clevo_sched_take_failed();
+
+	// queued writes would race with the readback
+	clevo_sched_sync();
+
+	kbd_reconcile_stats.reads++;
+	err = clevo_sched_query(cmd_class, WMI_SUBMETHOD_ID_GET_KB_LEDS_BW, 0, &shown);
+	if (err) {
+		kbd_reconcile_stats.failed++;
+		return err;
+	}
+
+	shown &= 0xFF;
+	requested = clevo_keyboard_shown_enabled() ? kbd_led_state.brightness : 0;
+
+	if (shown == requested) {
+		kbd_reconcile_stats.matched++;
+	}
+	else if (adopt && !kbd_forced_off && shown <= BRIGHTNESS_MAX_BW) {
+		pr_info("Firmware changed brightness to %u\n", shown);
+		kbd_reconcile_stats.adopted++;
+		// off is brightness 0 here, enabled stays so the hotkeys can relight it
+		kbd_led_state.brightness = shown;
+	}
+	else {
+		kbd_reconcile_stats.corrected++;
+		clevo_keyboard_mark_dirty(fields);
+		return 0;
+	}
+
+	kbd_deferred &= ~fields;
+	kbd_dirty &= ~fields;
+	clevo_sched_retry_resolved(fields);
+
+	return 0;
+}
+
+static ssize_t show_reconcile_fs(struct device *child,
+				 struct device_attribute *attr, char *buffer)
+{
+	ssize_t len;
+
+	mutex_lock(&kbd_lock);
+	len = sprintf(buffer, "reads: %llu\nfailed: %llu\nmatched: %llu\nadopted: %llu\ncorrected: %llu\n",
+		      kbd_reconcile_stats.reads, kbd_reconcile_stats.failed,
+		      kbd_reconcile_stats.matched, kbd_reconcile_stats.adopted,
+		      kbd_reconcile_stats.corrected);
+	mutex_unlock(&kbd_lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(reconcile, 0444, show_reconcile_fs, NULL);
+
+// Typing reaction
+//
+// Key presses only set a bit for their zone. A frame work, capped at
+// reactive_fps, turns those into a per zone intensity that decays over
+// reactive_decay_ms and hands it to the compositor, so however fast the
+// typing only changed zones reach the firmware, at most once per frame.
+// Keyboards are only opened while the reaction is enabled on an RGB keyboard.
+
+static unsigned long kbd_reactive_hits; /* zones hit since the last frame */
+static unsigned long kbd_reactive_last_frame;
+
+static void clevo_reactive_frame_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(kbd_reactive_work, clevo_reactive_frame_fn);
+
+static unsigned long clevo_reactive_frame_jiffies(void)
+{
+	return msecs_to_jiffies(1000 / clamp_t(uint, param_reactive_fps, 1, 1000));
+}
+
+static int clevo_key_zone(unsigned int code)
+{
+	switch (code) {
+	case KEY_NUMLOCK:
+	case KEY_KPASTERISK:
+	case KEY_KP7 ... KEY_KPDOT:
+	case KEY_KPENTER:
+	case KEY_KPSLASH:
+	case KEY_KPEQUAL:
+	case KEY_KPPLUSMINUS:
+	case KEY_KPCOMMA:
+		return kbd_led_state.has_extra == 1 ? ZONE_EXTRA : ZONE_RIGHT;
+
+	case KEY_ESC:
+	case KEY_GRAVE:
+	case KEY_1 ... KEY_4:
+	case KEY_TAB:
+	case KEY_Q ... KEY_R:
+	case KEY_CAPSLOCK:
+	case KEY_A ... KEY_F:
+	case KEY_LEFTSHIFT:
+	case KEY_102ND:
+	case KEY_Z ... KEY_V:
+	case KEY_LEFTCTRL:
+	case KEY_LEFTMETA:
+	case KEY_LEFTALT:
+	case KEY_F1 ... KEY_F4:
+		return ZONE_LEFT;
+
+	case KEY_9 ... KEY_BACKSPACE:
+	case KEY_O ... KEY_ENTER:
+	case KEY_L ... KEY_APOSTROPHE:
+	case KEY_BACKSLASH:
+	case KEY_DOT ... KEY_RIGHTSHIFT:
+	case KEY_RIGHTALT:
+	case KEY_RIGHTCTRL:
+	case KEY_RIGHTMETA:
+	case KEY_COMPOSE:
+	case KEY_F9 ... KEY_F10:
+	case KEY_F11 ... KEY_F12:
+	case KEY_SYSRQ:
+	case KEY_SCROLLLOCK:
+	case KEY_PAUSE:
+	case KEY_HOME ... KEY_DELETE:
+		return ZONE_RIGHT;
+
+	default:
+		return ZONE_CENTER;
+	}
+}
+
+// input callback, atomic context
+static void clevo_reactive_key(unsigned int code)
+{
+	unsigned long next;
+
+	if (!param_reactive || !clevo_kbd_is_rgb())
+		return;
+
+	set_bit(clevo_key_zone(code), &kbd_reactive_hits);
+
+	next = READ_ONCE(kbd_reactive_last_frame) + clevo_reactive_frame_jiffies();
+	queue_delayed_work(system_wq, &kbd_reactive_work,
+			   time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+static void clevo_reactive_frame_fn(struct work_struct *work)
+{
+	unsigned long now = jiffies;
+	uint decay_ms = max(param_reactive_decay_ms, 1U);
+	u32 decay, zones = 0;
+	bool active = false;
+	int zone;
+	u8 alpha;
+
+	decay = min_t(u32, jiffies_to_msecs(now - kbd_reactive_last_frame) * 255 / decay_ms, 255);
+	WRITE_ONCE(kbd_reactive_last_frame, now);
+
+	mutex_lock(&kbd_lock);
+
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		alpha = kbd_reactive_alpha[zone];
+
+		if (test_and_clear_bit(zone, &kbd_reactive_hits))
+			alpha = 255;
+		else
+			alpha = alpha > decay ? alpha - decay : 0;
+
+		if (!param_reactive)
+			alpha = 0;
+
+		if (alpha != kbd_reactive_alpha[zone]) {
+			kbd_reactive_alpha[zone] = alpha;
+			zones |= KBD_DIRTY_ZONE(zone);
+		}
+
+		active |= alpha != 0;
+	}
+
+	clevo_compositor_update(zones);
+	clevo_keyboard_commit(CLEVO_CMD_EFFECT);
+
+	mutex_unlock(&kbd_lock);
+
+	if (active)
+		queue_delayed_work(system_wq, &kbd_reactive_work, clevo_reactive_frame_jiffies());
+}
+
+// opens a matched input device, shared by the keyboard and lid handlers
+static int clevo_input_open(struct input_handler *handler, struct input_dev *dev)
+{
+	struct input_handle *handle;
+	int err;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = KBUILD_MODNAME;
+
+	err = input_register_handle(handle);
+	if (err)
+		goto err_free;
+
+	err = input_open_device(handle);
+	if (err)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return err;
+}
+
+static void clevo_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static void clevo_reactive_event(struct input_handle *handle, unsigned int type,
+				 unsigned int code, int value)
+{
+	// presses only, no releases or autorepeat
+	if (type == EV_KEY && value == 1)
+		clevo_reactive_key(code);
+}
+
+static int clevo_reactive_connect(struct input_handler *handler, struct input_dev *dev,
+				  const struct input_device_id *id)
+{
+	return clevo_input_open(handler, dev);
+}
+
+static const struct input_device_id clevo_reactive_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_KEYBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+		.keybit = { [BIT_WORD(KEY_A)] = BIT_MASK(KEY_A) },
+	},
+	{ }
+};
+
+static struct input_handler clevo_reactive_handler = {
+	.event = clevo_reactive_event,
+	.connect = clevo_reactive_connect,
+	.disconnect = clevo_input_disconnect,
+	.name = KBUILD_MODNAME "_reactive",
+	.id_table = clevo_reactive_ids,
+};
+
+static DEFINE_MUTEX(kbd_reactive_lock);
+static bool kbd_reactive_ready;      /* keyboard type known, module not unloading */
+static bool kbd_reactive_registered;
+
+// binds or unbinds the keyboards after the reactive parameter or the driver state changed
+static void clevo_reactive_update(void)
+{
+	bool want;
+
+	mutex_lock(&kbd_reactive_lock);
+
+	want = kbd_reactive_ready && param_reactive && clevo_kbd_is_rgb();
+
+	if (want && !kbd_reactive_registered) {
+		if (input_register_handler(&clevo_reactive_handler))
+			pr_err("Could not register keyboard handler\n");
+		else
+			kbd_reactive_registered = true;
+	}
+	else if (!want && kbd_reactive_registered) {
+		input_unregister_handler(&clevo_reactive_handler);
+		kbd_reactive_registered = false;
+
+		// one more frame clears what is still lit
+		if (kbd_reactive_ready)
+			queue_delayed_work(system_wq, &kbd_reactive_work, 0);
+	}
+
+	mutex_unlock(&kbd_reactive_lock);
+}
+
+static void clevo_reactive_init(void)
+{
+	mutex_lock(&kbd_reactive_lock);
+	kbd_reactive_ready = true;
+	mutex_unlock(&kbd_reactive_lock);
+
+	clevo_reactive_update();
+}
+
+static void clevo_reactive_exit(void)
+{
+	mutex_lock(&kbd_reactive_lock);
+	kbd_reactive_ready = false;
+	mutex_unlock(&kbd_reactive_lock);
+
+	clevo_reactive_update();
+	cancel_delayed_work_sync(&kbd_reactive_work);
+}
+
+// Lid and display blank
+//
+// Input and framebuffer callbacks only record what happened, the work
+// applies it under kbd_lock. Switching a source on or off changes just the
+// enabled field; everything requested meanwhile stays deferred and goes out
+// with the one commit that switches the backlight back on.
+
+#define KBD_EVENT_LID_CLOSED 0
+#define KBD_EVENT_BLANKED 1
+
+static unsigned long kbd_off_events;
+
+static void clevo_forced_off_work_fn(struct work_struct *work)
+{
+	bool shown;
+	u32 sources = 0;
+
+	if (param_lid_off && test_bit(KBD_EVENT_LID_CLOSED, &kbd_off_events))
+		sources |= KBD_OFF_LID;
+	if (param_blank_off && test_bit(KBD_EVENT_BLANKED, &kbd_off_events))
+		sources |= KBD_OFF_BLANK;
+
+	mutex_lock(&kbd_lock);
+
+	shown = clevo_keyboard_shown_enabled();
+	kbd_forced_off = (kbd_forced_off & ~KBD_OFF_EVENTS) | sources;
+
+	if (shown != clevo_keyboard_shown_enabled()) {
+		pr_debug("backlight %s (sources %#x)\n", shown ? "forced off" : "restored", sources);
+		clevo_keyboard_mark_dirty(KBD_DIRTY_ENABLED);
+		clevo_keyboard_commit(CLEVO_CMD_HOTKEY);
+	}
+
+	mutex_unlock(&kbd_lock);
+}
+
+static DECLARE_WORK(kbd_forced_off_work, clevo_forced_off_work_fn);
+
+static void clevo_off_event(int event, bool set)
+{
+	if (set)
+		set_bit(event, &kbd_off_events);
+	else
+		clear_bit(event, &kbd_off_events);
+
+	schedule_work(&kbd_forced_off_work);
+}
+
+static void clevo_lid_event(struct input_handle *handle, unsigned int type,
+			    unsigned int code, int value)
+{
+	if (type == EV_SW && code == SW_LID)
+		clevo_off_event(KBD_EVENT_LID_CLOSED, value);
+}
+
+static int clevo_lid_connect(struct input_handler *handler, struct input_dev *dev,
+			     const struct input_device_id *id)
+{
+	int err = clevo_input_open(handler, dev);
+
+	if (!err)
+		clevo_off_event(KBD_EVENT_LID_CLOSED, test_bit(SW_LID, dev->sw));
+
+	return err;
+}
+
+static const struct input_device_id clevo_lid_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_SWBIT,
+		.evbit = { BIT_MASK(EV_SW) },
+		.swbit = { [BIT_WORD(SW_LID)] = BIT_MASK(SW_LID) },
+	},
+	{ }
+};
+
+static struct input_handler clevo_lid_handler = {
+	.event = clevo_lid_event,
+	.connect = clevo_lid_connect,
+	.disconnect = clevo_input_disconnect,
+	.name = KBUILD_MODNAME,
+	.id_table = clevo_lid_ids,
+};
+
+static bool clevo_lid_registered;
+
+#if CLEVO_FB_BLANK
+static int clevo_fb_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+	struct fb_event *event = data;
+
+	if (action != FB_EVENT_BLANK || !event->data)
+		return NOTIFY_DONE;
+
+	clevo_off_event(KBD_EVENT_BLANKED, *(int *)event->data != FB_BLANK_UNBLANK);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block clevo_fb_notifier = {
+	.notifier_call = clevo_fb_notify,
+};
+
+static bool clevo_fb_registered;
+
+static void clevo_blank_init(void)
+{
+	if (fb_register_client(&clevo_fb_notifier))
+		pr_err("Could not register display blank notifier\n");
+	else
+		clevo_fb_registered = true;
+}
+
+static void clevo_blank_exit(void)
+{
+	if (clevo_fb_registered)
+		fb_unregister_client(&clevo_fb_notifier);
+}
+#else
+static void clevo_blank_init(void)
+{
+	if (param_blank_off)
+		pr_info("Display blank events not available in this kernel, blank_off has no effect\n");
+}
+
+static void clevo_blank_exit(void)
+{
+}
+#endif
+
+static void clevo_forced_off_init(void)
+{
+	if (input_register_handler(&clevo_lid_handler))
+		pr_err("Could not register lid switch handler\n");
+	else
+		clevo_lid_registered = true;
+
+	clevo_blank_init();
+}
+
+static void clevo_forced_off_exit(void)
+{
+	clevo_blank_exit();
+
+	if (clevo_lid_registered)
+		input_unregister_handler(&clevo_lid_handler);
+
+	cancel_work_sync(&kbd_forced_off_work);
+}
+
+// Ambient light sensor
+//
+// iio_channel_get() only finds channels through a consumer mapping (device
+// tree, ACPI or an iio_map registered by the sensor driver), and no sensor
+// maps a channel to this driver. The sensor is therefore found by its name on
+// the IIO bus and its channel wrapped by hand for iio_read_channel_processed().
+// Referencing iio_bus_type makes the module depend on industrialio whenever
+// IIO is available, also with als_device unset.
+
+#if IS_REACHABLE(CONFIG_IIO)
+
+struct kbd_als_t {
+	struct iio_dev *indio_dev;
+	struct iio_channel channel;
+	struct delayed_work work;
+	int step;             /* last applied step, -1 = none yet */
+	unsigned long last_change;
+};
+
+static struct kbd_als_t kbd_als = {
+	.step = -1,
+};
+
+static int clevo_als_match(struct device *dev, const void *data)
+{
+	// triggers live on the iio bus too, only look at real devices
+	if (strncmp(dev_name(dev), "iio:device", 10))
+		return 0;
+
+	// not every driver names its device
+	if (!dev_to_iio_dev(dev)->name)
+		return 0;
+
+	return sysfs_streq(dev_to_iio_dev(dev)->name, data);
+}
+
+static int clevo_als_lookup(void)
+{
+	struct device *dev;
+	struct iio_dev *indio_dev;
+	int i;
+
+	dev = bus_find_device(&iio_bus_type, NULL, param_als_device, clevo_als_match);
+	if (!dev)
+		return -ENODEV;
+
+	indio_dev = dev_to_iio_dev(dev);
+
+	if (param_als_channel >= 0) {
+		i = param_als_channel;
+	}
+	else {
+		for (i = 0; i < indio_dev->num_channels; i++) {
+			if (indio_dev->channels[i].type == IIO_LIGHT)
+				break;
+		}
+	}
+
+	if (i >= indio_dev->num_channels) {
+		pr_err("als: no usable channel on %s\n", param_als_device);
+		put_device(dev);
+		return -EINVAL;
+	}
+
+	kbd_als.indio_dev = indio_dev;
+	kbd_als.channel.indio_dev = indio_dev;
+	kbd_als.channel.channel = &indio_dev->channels[i];
+
+	pr_info("als: using %s channel %d\n", param_als_device, i);
+
+	return 0;
+}
+
+static int clevo_als_levels(void)
+{
+	if (!clevo_kbd_is_rgb())
+		return BRIGHTNESS_MAX_BW;
+
+	return BRIGHTNESS_MAX / BRIGHTNESS_STEP;
+}
+
+/*
+ * Maps a lux reading to a brightness step, 0 = off, clevo_als_levels() = full.
+ * The sensor range between als_lux_dark and als_lux_bright is split in equal
+ * bands, one per step. The current step is kept as long as the reading stays
+ * within its band widened by als_hysteresis percent on both sides.
+ */
+static int clevo_als_step(int lux)
+{
+	int levels = clevo_als_levels();
+	int dark = param_als_lux_dark;
+	int width = max_t(int, ((int)param_als_lux_bright - dark) / levels, 1);
+	int margin = width * (int)param_als_hysteresis / 100;
+	int band;
+
+	if (kbd_als.step >= 0 && kbd_als.step <= levels) {
+		band = levels - kbd_als.step;
+
+		if ((band == 0 || lux >= dark + band * width - margin) &&
+		    (band == levels || lux < dark + (band + 1) * width + margin))
+			return kbd_als.step;
+	}
+
+	band = lux <= dark ? 0 : (lux - dark) / width;
+
+	return levels - clamp(band, 0, levels);
+}
+
+static u8 clevo_als_step_brightness(int step)
+{
+	if (!clevo_kbd_is_rgb())
+		return step;
+
+	if (step >= BRIGHTNESS_MAX / BRIGHTNESS_STEP)
+		return BRIGHTNESS_MAX;
+
+	return step * BRIGHTNESS_STEP;
+}
+
+static void clevo_als_work_fn(struct work_struct *work)
+{
+	int lux;
+	int step;
+	int err;
+
+	if (!kbd_als.indio_dev && clevo_als_lookup())
+		goto out;
+
+	err = iio_read_channel_processed(&kbd_als.channel, &lux);
+	if (err < 0) {
+		pr_debug("als: read failed (%d)\n", err);
+		goto out;
+	}
+
+	step = clevo_als_step(max(lux, 0));
+
+	if (step == kbd_als.step)
+		goto out;
+
+	// rate limit, the first reading is always applied
+	if (kbd_als.step >= 0 &&
+	    time_before(jiffies, kbd_als.last_change +
+			msecs_to_jiffies(param_als_min_interval_ms)))
+		goto out;
+
+	pr_debug("als: %d lux, step %d -> %d\n", lux, kbd_als.step, step);
+
+	kbd_als.step = step;
+	kbd_als.last_change = jiffies;
+
+	mutex_lock(&kbd_lock);
+	if (kbd_led_state.brightness != clevo_als_step_brightness(step)) {
+		set_brightness(clevo_als_step_brightness(step));
+		clevo_keyboard_commit(CLEVO_CMD_EFFECT);
+	}
+	mutex_unlock(&kbd_lock);
+
+out:
+	queue_delayed_work(system_freezable_wq, &kbd_als.work,
+			   msecs_to_jiffies(max(param_als_poll_ms, 100U)));
+}
+
+static void clevo_als_init(void)
+{
+	if (!param_als_device || !*param_als_device)
+		return;
+
+	INIT_DELAYED_WORK(&kbd_als.work, clevo_als_work_fn);
+	queue_delayed_work(system_freezable_wq, &kbd_als.work, 0);
+}
+
+static void clevo_als_exit(void)
+{
+	if (!param_als_device || !*param_als_device)
+		return;
+
+	cancel_delayed_work_sync(&kbd_als.work);
+
+	if (kbd_als.indio_dev)
+		put_device(&kbd_als.indio_dev->dev);
+}
+
+#else
+
+static void clevo_als_init(void)
+{
+	if (param_als_device && *param_als_device)
+		pr_warn("als: kernel built without IIO support\n");
+}
+
+static void clevo_als_exit(void)
+{
+}
+
+#endif
+
+// Control device and leases
+//
+// /dev/clevo_platform takes whitespace separated commands:
+//   lease        take exclusive write access, blocks unless O_NONBLOCK
+//   release      give it back, closing the fd does the same
+//   key=value    brightness, state, color_left, color_center, color_right,
+//                color_extra, pattern; all pairs of one write are applied
+//                with a single commit
+// Reading it returns the current state in the same key=value form, plus
+// type=rgb|bw; brightness is always on the 0-255 scale writes use.
+// While a lease is held, writes from other processes (sysfs or control
+// device) are rejected with -EBUSY, or queued when lease_wait is set.
+
+static struct {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	struct file *holder;
+	pid_t tgid;
+	char comm[TASK_COMM_LEN];
+	u64 acquired;
+	u64 contended;
+	u64 rejected;
+	u64 waited;
+	bool closing;  /* module unloading, waiters give up */
+} clevo_lease = {
+	.lock = __SPIN_LOCK_UNLOCKED(clevo_lease.lock),
+	.wait = __WAIT_QUEUE_HEAD_INITIALIZER(clevo_lease.wait),
+};
+
+static bool clevo_lease_allowed(struct file *file)
+{
+	bool allowed;
+
+	spin_lock(&clevo_lease.lock);
+	allowed = !clevo_lease.holder ||
+		  (file && clevo_lease.holder == file) ||
+		  clevo_lease.tgid == task_tgid_nr(current);
+	spin_unlock(&clevo_lease.lock);
+
+	return allowed;
+}
+
+static bool clevo_lease_wait_done(struct file *file)
+{
+	return clevo_lease_allowed(file) || READ_ONCE(clevo_lease.closing);
+}
+
+/*
+ * Takes kbd_lock for a write that the lease allows, file is NULL for sysfs
+ * writers. Acquiring a lease also takes kbd_lock, so once the check passed
+ * under it no lease can start before the write is applied.
+ */
+static int clevo_lease_lock(struct file *file)
+{
+	bool waited = false;
+	int err;
+
+	for (;;) {
+		mutex_lock(&kbd_lock);
+		if (clevo_lease_allowed(file))
+			return 0;
+		mutex_unlock(&kbd_lock);
+
+		if (!param_lease_wait || (file && (file->f_flags & O_NONBLOCK))) {
+			spin_lock(&clevo_lease.lock);
+			clevo_lease.rejected++;
+			spin_unlock(&clevo_lease.lock);
+			return -EBUSY;
+		}
+
+		if (!waited) {
+			spin_lock(&clevo_lease.lock);
+			clevo_lease.waited++;
+			spin_unlock(&clevo_lease.lock);
+			waited = true;
+		}
+
+		err = wait_event_interruptible(clevo_lease.wait, clevo_lease_wait_done(file));
+		if (err)
+			return err;
+
+		// sysfs writers pin the attribute, let unload remove it
+		if (READ_ONCE(clevo_lease.closing))
+			return -ENODEV;
+	}
+}
+
+// wakes lease waiters before the attributes they pin are removed
+static void clevo_lease_exit(void)
+{
+	WRITE_ONCE(clevo_lease.closing, true);
+	wake_up_interruptible_all(&clevo_lease.wait);
+}
+
+static bool clevo_lease_try_acquire(struct file *file)
+{
+	bool acquired = false;
+
+	spin_lock(&clevo_lease.lock);
+	if (!clevo_lease.holder || clevo_lease.holder == file) {
+		if (!clevo_lease.holder)
+			clevo_lease.acquired++;
+		clevo_lease.holder = file;
+		clevo_lease.tgid = task_tgid_nr(current);
+		get_task_comm(clevo_lease.comm, current);
+		acquired = true;
+	}
+	spin_unlock(&clevo_lease.lock);
+
+	return acquired;
+}
 
-	case EVENT_CODE_NEXT_BLINKING_PATTERN:
-		if (kbd_led_state.mode == KB_TYPE_RGB) {
-			set_next_color_whole_kb();
-		}
-		break;
+static bool clevo_lease_free(struct file *file)
+{
+	return !READ_ONCE(clevo_lease.holder) || READ_ONCE(clevo_lease.holder) == file;
+}
 
-	case EVENT_CODE_TOGGLE_STATE_2:
-	case EVENT_CODE_TOGGLE_STATE:
-		if (kbd_led_state.mode == KB_TYPE_RGB) {
-			set_enabled(kbd_led_state.enabled == 0 ? 1 : 0);
-		}
-		
-		if (kbd_led_state.mode == KB_TYPE_BW) {
-			set_brightness(kbd_led_state.brightness == 0 ? BRIGHTNESS_MAX_BW : 0);
+static int clevo_lease_acquire(struct file *file)
+{
+	bool contended = false;
+	bool acquired;
+	int err;
+
+	for (;;) {
+		// under kbd_lock, see clevo_lease_lock()
+		mutex_lock(&kbd_lock);
+		acquired = clevo_lease_try_acquire(file);
+		mutex_unlock(&kbd_lock);
+
+		if (acquired)
+			return 0;
+
+		if (!contended) {
+			spin_lock(&clevo_lease.lock);
+			clevo_lease.contended++;
+			spin_unlock(&clevo_lease.lock);
+			contended = true;
 		}
-		break;
 
-	default:
-		pr_info("unmanaged event: (%0#10x)\n", event);
-		break;
+		if (file->f_flags & O_NONBLOCK)
+			return -EBUSY;
+
+		err = wait_event_interruptible(clevo_lease.wait, clevo_lease_free(file));
+		if (err)
+			return err;
 	}
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
-static void clevo_wmi_notify(union acpi_object *obj, void *context)
+static void clevo_lease_release(struct file *file)
 {
-	if (!obj)
-		return;
+	bool released = false;
 
-	if (obj->type == ACPI_TYPE_INTEGER) {
-		u32 event;
-		clevo_wmi_evaluate_wmbb_method(WMI_SUBMETHOD_ID_GET_EVENT, 0, &event);
-		clevo_keyboard_event_callb(event);
+	spin_lock(&clevo_lease.lock);
+	if (clevo_lease.holder == file) {
+		clevo_lease.holder = NULL;
+		clevo_lease.tgid = 0;
+		released = true;
 	}
+	spin_unlock(&clevo_lease.lock);
+
+	if (released)
+		wake_up_interruptible(&clevo_lease.wait);
 }
-#else
-static void clevo_wmi_notify(u32 value, void *context)
+
+// one key=value pair of a control write, fields are KBD_DIRTY_* bits
+struct clevo_batch_t {
+	u32 fields;
+	u8 brightness;
+	u8 state;
+	u8 pattern;
+	u32 color[ZONE_COUNT];
+};
+
+static const char * const clevo_ctl_zone_keys[ZONE_COUNT] = {
+	"color_left", "color_center", "color_right", "color_extra"
+};
+
+static int clevo_batch_parse(struct clevo_batch_t *batch, char *token)
 {
-	u32 event;
+	char *value = strchr(token, '=');
+	unsigned int num;
+	int zone;
+	int err;
 
-	if (value != 0xD0) {
-		pr_info("Unexpected WMI event (%0#6x)\n", value);
-		return;
+	if (!value)
+		return -EINVAL;
+	*value++ = '\0';
+
+	if (!strcmp(token, "brightness")) {
+		err = kstrtouint(value, 0, &num);
+		if (err)
+			return err;
+		batch->brightness = clevo_user_brightness(num);
+		batch->fields |= KBD_DIRTY_BRIGHTNESS;
+		return 0;
 	}
 
-	clevo_wmi_evaluate_wmbb_method(WMI_SUBMETHOD_ID_GET_EVENT, 0, &event);
-	clevo_keyboard_event_callb(event);
+	if (!strcmp(token, "state")) {
+		err = kstrtouint(value, 0, &num);
+		if (err)
+			return err;
+		batch->state = clamp_t(u8, num, 0, 1);
+		batch->fields |= KBD_DIRTY_ENABLED;
+		return 0;
+	}
+
+	if (!strcmp(token, "pattern")) {
+		err = clevo_parse_pattern(value);
+		if (err < 0)
+			return err;
+		batch->pattern = err;
+		batch->fields |= KBD_DIRTY_PATTERN;
+		return 0;
+	}
+
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		if (strcmp(token, clevo_ctl_zone_keys[zone]))
+			continue;
+
+		err = kstrtouint(value, 16, &num);
+		if (err)
+			return err;
+		batch->color[zone] = num;
+		batch->fields |= KBD_DIRTY_ZONE(zone);
+		return 0;
+	}
+
+	return -EINVAL;
 }
-#endif
 
-static int clevo_acpi_add(struct acpi_device *device)
+// called with kbd_lock held
+static void clevo_batch_apply(const struct clevo_batch_t *batch)
 {
-	u32 result;
+	int zone;
 
-	pr_info("%s",__PRETTY_FUNCTION__);
+	if (batch->fields & KBD_DIRTY_PATTERN)
+		set_blinking_pattern(batch->pattern);
 
-	active_device = device;
+	for (zone = 0; zone < ZONE_COUNT; zone++) {
+		if (batch->fields & KBD_DIRTY_ZONE(zone))
+			set_color_code_region(zone_regions[zone], batch->color[zone]);
+	}
 
-	// This is the get_app method for the keyboard, without it we would not get event notifications.
-	clevo_acpi_evaluate_method(device, WMI_SUBMETHOD_ID_GET_AP, 0, &result);
+	if (batch->fields & KBD_DIRTY_BRIGHTNESS)
+		set_brightness(batch->brightness);
 
-	return 0;
+	if (batch->fields & KBD_DIRTY_ENABLED)
+		set_enabled(batch->state);
+
+	clevo_keyboard_commit(CLEVO_CMD_USER);
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
-static void clevo_acpi_remove(struct acpi_device *device)
+static ssize_t clevo_ctl_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
 {
-	pr_info("%s",__PRETTY_FUNCTION__);
+	struct clevo_batch_t batch = { 0 };
+	char *buf, *cursor, *token;
+	ssize_t err;
+
+	if (count >= PAGE_SIZE)
+		return -E2BIG;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	cursor = buf;
+	while ((token = strsep(&cursor, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+
+		if (!strcmp(token, "lease")) {
+			err = clevo_lease_acquire(file);
+		}
+		else if (!strcmp(token, "release")) {
+			clevo_lease_release(file);
+			err = 0;
+		}
+		else {
+			err = clevo_batch_parse(&batch, token);
+		}
+
+		if (err)
+			goto out;
+	}
+
+	if (batch.fields) {
+		err = clevo_lease_lock(file);
+		if (err)
+			goto out;
+
+		clevo_batch_apply(&batch);
+		mutex_unlock(&kbd_lock);
+
+		clevo_sched_sync();
+	}
 
+	err = count;
+out:
+	kfree(buf);
+	return err;
 }
-#else
-static int clevo_acpi_remove(struct acpi_device *device)
+
+static ssize_t clevo_ctl_read(struct file *file, char __user *ubuf,
+			      size_t count, loff_t *ppos)
 {
-	pr_info("%s",__PRETTY_FUNCTION__);
-	return 0;
+	char buf[192];
+	int brightness;
+	int len, zone;
+
+	mutex_lock(&kbd_lock);
+
+	brightness = kbd_led_state.brightness;
+	if (!clevo_kbd_is_rgb())
+		brightness *= BRIGHTNESS_MAX / BRIGHTNESS_MAX_BW;
+
+	len = scnprintf(buf, sizeof(buf), "type=%s state=%u brightness=%d pattern=%s",
+			clevo_kbd_is_rgb() ? "rgb" : "bw", kbd_led_state.enabled, brightness,
+			blinking_patterns[kbd_led_state.blinking_pattern].name);
+
+	for (zone = 0; zone < ZONE_COUNT; zone++)
+		len += scnprintf(buf + len, sizeof(buf) - len, " %s=%06x",
+				 clevo_ctl_zone_keys[zone], *kbd_zone_color(zone));
+
+	mutex_unlock(&kbd_lock);
+
+	len += scnprintf(buf + len, sizeof(buf) - len, "\n");
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
 }
-#endif
 
-void clevo_acpi_notify(struct acpi_device *device, u32 event)
+static int clevo_ctl_release(struct inode *inode, struct file *file)
 {
-	 pr_info("ACPI event: %0#10x\n", event);
-	clevo_keyboard_event_callb(event);
+	clevo_lease_release(file);
+
+	return 0;
 }
 
-static const struct acpi_device_id device_ids[] = {
-	{"CLV0001", 0},
-	{"", 0},
+static const struct file_operations clevo_ctl_fops = {
+	.owner = THIS_MODULE,
+	.read = clevo_ctl_read,
+	.write = clevo_ctl_write,
+	.release = clevo_ctl_release,
+	.llseek = default_llseek,
 };
 
-MODULE_DEVICE_TABLE(acpi, device_ids);
-
-static struct acpi_driver clevo_acpi_driver = {
-	.name = "Clevo Keyboard",
-	.class = "Clevo",
-	.ids = device_ids,
-	.flags = ACPI_DRIVER_ALL_NOTIFY_EVENTS,
-	.ops = {
-		.add = clevo_acpi_add,
-		.remove = clevo_acpi_remove,
-		.notify = clevo_acpi_notify,
-	},
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
-	.owner = THIS_MODULE,
-#endif	
+static struct miscdevice clevo_ctl_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = KBUILD_MODNAME,
+	.fops = &clevo_ctl_fops,
 };
 
+static ssize_t show_lease_fs(struct device *child,
+			     struct device_attribute *attr, char *buffer)
+{
+	ssize_t len;
+
+	spin_lock(&clevo_lease.lock);
+	if (clevo_lease.holder)
+		len = sprintf(buffer, "holder: %d (%s)\n", clevo_lease.tgid, clevo_lease.comm);
+	else
+		len = sprintf(buffer, "holder: none\n");
 
-void clevo_keyboard_write_state(void)
+	len += sprintf(buffer + len, "acquired: %llu\ncontended: %llu\nrejected: %llu\nwaited: %llu\n",
+		       clevo_lease.acquired, clevo_lease.contended,
+		       clevo_lease.rejected, clevo_lease.waited);
+	spin_unlock(&clevo_lease.lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(lease, 0444, show_lease_fs, NULL);
+
+// sleep cycles and the firmware calls the short paths saved
+static struct {
+	bool s2idle;   /* the current cycle takes the short path */
+	u64 s2idle_cycles;
+	u64 other_cycles;
+	u64 short_cycles;
+	u64 avoided;
+	uint last_avoided;
+} kbd_pm;
+
+static bool clevo_pm_s2idle(void)
 {
-	// Note:
-	// - set_blinking_pattern also writes colors
-	// - set_brightness, set_enabled, set_blinking_pattern
-	//   still also update state
-	if (kbd_led_state.mode == KB_TYPE_RGB) {
-		set_blinking_pattern(kbd_led_state.blinking_pattern);
-		set_brightness(kbd_led_state.brightness);
-		set_enabled(kbd_led_state.enabled);
-	}
+#ifdef CONFIG_PM_SLEEP
+	return pm_suspend_target_state == PM_SUSPEND_TO_IDLE;
+#else
+	return false;
+#endif
+}
 
-	if (kbd_led_state.mode == KB_TYPE_BW) {
-		set_brightness(kbd_led_state.brightness);
-	}
+// firmware calls of a full resume: GET_AP plus the state write or readback
+static uint clevo_pm_full_restore_calls(void)
+{
+	uint calls = 1;
+
+	if (!clevo_kbd_is_rgb())
+		return calls + 1;
+
+	calls += 3; /* pattern, brightness, enabled */
+	if (kbd_led_state.blinking_pattern == 0)
+		calls += kbd_led_state.has_extra == 1 ? ZONE_COUNT : ZONE_COUNT - 1;
+
+	return calls;
+}
+
+static ssize_t show_pm_stats_fs(struct device *child,
+				struct device_attribute *attr, char *buffer)
+{
+	ssize_t len;
+
+	mutex_lock(&kbd_lock);
+	len = sprintf(buffer, "s2idle_cycles: %llu\nother_cycles: %llu\nshort_cycles: %llu\ncalls_avoided: %llu\nlast_cycle_avoided: %u\n",
+		      kbd_pm.s2idle_cycles, kbd_pm.other_cycles, kbd_pm.short_cycles,
+		      kbd_pm.avoided, kbd_pm.last_avoided);
+	mutex_unlock(&kbd_lock);
+
+	return len;
 }
 
+static DEVICE_ATTR(pm_stats, 0444, show_pm_stats_fs, NULL);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
 static void clevo_platform_remove(struct platform_device *dev)
 {
 	pr_info("%s",__PRETTY_FUNCTION__);
 	device_remove_file(&dev->dev, &dev_attr_brightness);
 	device_remove_file(&dev->dev, &dev_attr_state);
+	device_remove_file(&dev->dev, &dev_attr_deferred);
+	device_remove_file(&dev->dev, &dev_attr_effect);
+	device_remove_file(&dev->dev, &dev_attr_lease);
+	device_remove_file(&dev->dev, &dev_attr_reconcile);
+	device_remove_file(&dev->dev, &dev_attr_backend);
+	device_remove_file(&dev->dev, &dev_attr_commit);
+	device_remove_file(&dev->dev, &dev_attr_layers);
+	device_remove_file(&dev->dev, &dev_attr_residency);
+	device_remove_file(&dev->dev, &dev_attr_pm_stats);
+	device_remove_file(&dev->dev, &dev_attr_sched_stats);
+	device_remove_file(&dev->dev, &dev_attr_retry_stats);
 	
 }
 #else
@@ -849,6 +3707,17 @@ static int clevo_platform_remove(struct platform_device *dev)
 	pr_info("%s",__PRETTY_FUNCTION__);
 	device_remove_file(&dev->dev, &dev_attr_brightness);
 	device_remove_file(&dev->dev, &dev_attr_state);
+	device_remove_file(&dev->dev, &dev_attr_deferred);
+	device_remove_file(&dev->dev, &dev_attr_effect);
+	device_remove_file(&dev->dev, &dev_attr_lease);
+	device_remove_file(&dev->dev, &dev_attr_reconcile);
+	device_remove_file(&dev->dev, &dev_attr_backend);
+	device_remove_file(&dev->dev, &dev_attr_commit);
+	device_remove_file(&dev->dev, &dev_attr_layers);
+	device_remove_file(&dev->dev, &dev_attr_residency);
+	device_remove_file(&dev->dev, &dev_attr_pm_stats);
+	device_remove_file(&dev->dev, &dev_attr_sched_stats);
+	device_remove_file(&dev->dev, &dev_attr_retry_stats);
 	
 	return 0;
 }
@@ -856,20 +3725,91 @@ static int clevo_platform_remove(struct platform_device *dev)
 
 static int clevo_platform_suspend(struct platform_device *dev, pm_message_t state)
 {
-	
-	if (kbd_led_state.mode == KB_TYPE_RGB) {
+	mutex_lock(&kbd_lock);
+
+	// RGB keyboards have no readback, so there the short path is opt-in
+	kbd_pm.s2idle = clevo_pm_s2idle() && (param_s2idle_fast || !clevo_kbd_is_rgb());
+	kbd_pm.last_avoided = 0;
+	if (clevo_pm_s2idle())
+		kbd_pm.s2idle_cycles++;
+	else
+		kbd_pm.other_cycles++;
+
+	// a fade out ends now, any other fade jumps to its target
+	if (kbd_fade.disable)
+		set_enabled(0);
+	else
+		clevo_fade_cancel();
+
+	if (clevo_kbd_is_rgb()) {
 		// turning the keyboard off prevents default colours showing on resume
-		set_enabled_cmd(0);
+		if (clevo_keyboard_shown_enabled()) {
+			kbd_forced_off |= KBD_OFF_SUSPEND;
+			clevo_keyboard_mark_dirty(KBD_DIRTY_ENABLED);
+			clevo_keyboard_commit(CLEVO_CMD_RESUME);
+		}
+		else {
+			kbd_pm.last_avoided++;
+		}
 	}
+
+	// anything requested from now on is flushed by resume
+	kbd_suspended = true;
+	clevo_residency_account();
+	mutex_unlock(&kbd_lock);
+
+	clevo_sched_sync();
 	return 0;
 }
 
 static int clevo_platform_resume(struct platform_device *dev)
 {
+	uint full, calls;
 
-	clevo_evaluate_method(WMI_SUBMETHOD_ID_GET_AP, 0, NULL);
+	mutex_lock(&kbd_lock);
 
-	clevo_keyboard_write_state();
+	kbd_suspended = false;
+
+	if (kbd_forced_off & KBD_OFF_SUSPEND) {
+		kbd_forced_off &= ~KBD_OFF_SUSPEND;
+		clevo_keyboard_mark_dirty(KBD_DIRTY_ENABLED);
+	}
+
+	// both paths re-arm the hotkey events, the firmware may have dropped them
+	clevo_sched_query(CLEVO_CMD_RESUME, WMI_SUBMETHOD_ID_GET_AP, 0, NULL);
+
+	/*
+	 * The EC stayed powered, so it should have kept everything: single color
+	 * keyboards confirm that with one readback, RGB keyboards only undo the
+	 * off. A failed readback takes the full restore below.
+	 */
+	if (kbd_pm.s2idle &&
+	    (clevo_kbd_is_rgb() || !clevo_keyboard_reconcile(CLEVO_CMD_RESUME, false))) {
+		full = clevo_pm_full_restore_calls();
+		calls = 1 + hweight32(kbd_dirty & ~clevo_keyboard_deferred_mask()) + !clevo_kbd_is_rgb();
+		kbd_pm.last_avoided += full > calls ? full - calls : 0;
+		kbd_pm.short_cycles++;
+
+		clevo_keyboard_commit(CLEVO_CMD_RESUME);
+		goto out;
+	}
+
+	if (kbd_led_state.enabled)
+		clevo_fade_start(0, kbd_led_state.brightness, false);
+
+	// resume may have restored firmware defaults, or kept what we wrote
+	if (clevo_keyboard_reconcile(CLEVO_CMD_RESUME, false))
+		clevo_keyboard_write_state();
+	else
+		clevo_keyboard_commit(CLEVO_CMD_RESUME);
+
+out:
+	kbd_pm.avoided += kbd_pm.last_avoided;
+
+	// suspend closed an off interval, start the next one even if nothing was written
+	clevo_residency_account();
+
+	mutex_unlock(&kbd_lock);
 
 	return 0;
 }
@@ -903,6 +3843,72 @@ static int clevo_platform_probe(struct platform_device *dev)
 		pr_err
 		    ("Sysfs attribute file creation failed for color right\n");
 	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_deferred) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for deferred\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_effect) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for effect\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_lease) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for lease\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_reconcile) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for reconcile\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_backend) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for backend\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_commit) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for commit\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_layers) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for layers\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_residency) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for residency\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_pm_stats) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for pm_stats\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_sched_stats) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for sched stats\n");
+	}
+
+	if (device_create_file
+	    (&dev->dev, &dev_attr_retry_stats) != 0) {
+		pr_err
+		    ("Sysfs attribute file creation failed for retry stats\n");
+	}
 	return 0;
 }
 
@@ -920,6 +3926,80 @@ static struct platform_driver platform_driver_clevo = {
 
 static struct platform_device* platform_device_clevo;
 
+static u64 __init clevo_backend_time(bool wmi)
+{
+	u64 best = U64_MAX;
+	ktime_t start;
+	u32 value;
+	int i;
+
+	for (i = 0; i < CLEVO_BACKEND_SAMPLES; i++) {
+		start = ktime_get();
+		if (wmi) {
+			if (clevo_wmi_evaluate_wmbb_method(WMI_SUBMETHOD_ID_GET_BIOS_1, 0, &value))
+				return U64_MAX;
+		}
+		else {
+			if (clevo_acpi_evaluate_method(active_device, WMI_SUBMETHOD_ID_GET_BIOS_1, 0, &value))
+				return U64_MAX;
+		}
+		best = min_t(u64, best, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	}
+
+	return best;
+}
+
+/*
+ * Picks the backend firmware commands go through. Events stay on the
+ * interface detection found (model), commands use the faster of WMI and the
+ * CLV0001 _DSM when a board has both, unless the backend parameter says
+ * otherwise.
+ */
+static void __init clevo_backend_select(void)
+{
+	bool has_wmi = CLEVO_HAS_V1 && wmi_has_guid(CLEVO_V1_GET_GUID);
+	bool has_acpi;
+	bool use_wmi;
+
+	// WMI boards only bind the ACPI device when it may take the commands
+	if (CLEVO_HAS_V2 && model == CLEVO_MODEL_V1 && strcmp(param_backend, "wmi")) {
+		if (acpi_bus_register_driver(&clevo_acpi_driver) < 0)
+			pr_info("ACPI backend not available\n");
+	}
+	has_acpi = CLEVO_HAS_V2 && active_device;
+
+	if (has_wmi)
+		clevo_backend.wmi_ns = clevo_backend_time(true);
+	if (has_acpi)
+		clevo_backend.acpi_ns = clevo_backend_time(false);
+
+	if (!strcmp(param_backend, "wmi") && has_wmi)
+		use_wmi = true;
+	else if (!strcmp(param_backend, "acpi") && has_acpi)
+		use_wmi = false;
+	else if (has_wmi && has_acpi)
+		use_wmi = clevo_backend.wmi_ns <= clevo_backend.acpi_ns;
+	else
+		use_wmi = has_wmi || (!has_acpi && model == CLEVO_MODEL_V1);
+
+	if (strcmp(param_backend, "auto") && strcmp(param_backend, use_wmi ? "wmi" : "acpi"))
+		pr_err("Backend %s not available\n", param_backend);
+
+	pr_info("Using %s for commands (wmi: %lld ns, acpi: %lld ns)\n",
+		use_wmi ? "WMI" : "ACPI",
+		clevo_backend.wmi_ns == U64_MAX ? -1LL : (s64)clevo_backend.wmi_ns,
+		clevo_backend.acpi_ns == U64_MAX ? -1LL : (s64)clevo_backend.acpi_ns);
+
+	if (use_wmi)
+		static_branch_enable(&clevo_v1_key);
+
+	// bound only for commands, WMI still delivers the events
+	if (use_wmi && CLEVO_HAS_V2 && model == CLEVO_MODEL_V1 && active_device) {
+		acpi_bus_unregister_driver(&clevo_acpi_driver);
+		active_device = NULL;
+	}
+}
+
 static int __init clevo_platform_init(void)
 {
 	int result = 0;
@@ -929,10 +4009,14 @@ static int __init clevo_platform_init(void)
 
 	dmi_check_system(slimbook_dmi_table);
 
+	result = clevo_sched_init();
+	if (result)
+		return result;
+
 	if (acpi_dev_found("CLV0001")) {
 		pr_info("Clevo device found");
 
-		if( wmi_has_guid(CLEVO_V1_EVENT_GUID) ) {
+		if( CLEVO_HAS_V1 && wmi_has_guid(CLEVO_V1_EVENT_GUID) ) {
 			pr_info("Using Clevo WMI");
 			model = CLEVO_MODEL_V1;
 
@@ -941,14 +4025,12 @@ static int __init clevo_platform_init(void)
 			if (unlikely(ACPI_FAILURE(result))) {
 				pr_err("Could not register WMI notify handler (%0#6x)\n",
 					result);
+				clevo_sched_exit();
 				return -EIO;
 			}
-
-			// Why is this needed? does it return something?
-			clevo_wmi_evaluate_wmbb_method(WMI_SUBMETHOD_ID_GET_AP, 0, &event);
 		}
 		else {
-			if( wmi_has_guid(CLEVO_V2_EVENT_GUID) ) {
+			if( CLEVO_HAS_V2 && wmi_has_guid(CLEVO_V2_EVENT_GUID) ) {
 				pr_info("Using Clevo ACPI");
 				model = CLEVO_MODEL_V2;
 
@@ -956,10 +4038,17 @@ static int __init clevo_platform_init(void)
 
 				if (result < 0) {
 					ACPI_DEBUG_PRINT((ACPI_DB_ERROR, "Error registering driver\n"));
+					clevo_sched_exit();
 					return -ENODEV;
 				}
 
 			}
+			else if (!CLEVO_HAS_V1 || !CLEVO_HAS_V2) {
+				// the board's interface was compiled out, every call would fail
+				pr_err("Backend not supported by this build\n");
+				clevo_sched_exit();
+				return -ENODEV;
+			}
 			else {
 				pr_info("Unknown Clevo model");
 			}
@@ -968,13 +4057,21 @@ static int __init clevo_platform_init(void)
 	else {
 		pr_info("No Clevo device found");
 
+		clevo_sched_exit();
 		return -ENODEV;
 	}
 
+	clevo_backend_select();
+
+	if (CLEVO_HAS_V1 && model == CLEVO_MODEL_V1) {
+		// Why is this needed? does it return something?
+		clevo_sched_query(CLEVO_CMD_RESUME, WMI_SUBMETHOD_ID_GET_AP, 0, &event);
+	}
+
 	result = platform_driver_register(&platform_driver_clevo);
 	if (result < 0) {
 		pr_err("Failed to create platform driver:%d",result);
-		return -ENODEV;
+		goto error_driver_register;
 	}
 
 	platform_device_clevo = platform_device_alloc(KBUILD_MODNAME, -1);
@@ -991,7 +4088,7 @@ static int __init clevo_platform_init(void)
 	}
 
 	uint32_t value;
-	uint32_t status = clevo_evaluate_method(WMI_SUBMETHOD_ID_GET_BIOS_1,0x00,&value);
+	int status = clevo_sched_query(CLEVO_CMD_USER, WMI_SUBMETHOD_ID_GET_BIOS_1,0x00,&value);
 	
 	if (!status) {
 		pr_info("Bios Feature register:%x\n",value);
@@ -1010,6 +4107,14 @@ static int __init clevo_platform_init(void)
 		pr_info("quirk: force rgb keyboard\n");
 		kbd_led_state.mode = KB_TYPE_RGB;
 	}
+
+	if (kbd_led_state.mode == KB_TYPE_RGB ? !CLEVO_HAS_RGB : !CLEVO_HAS_BW) {
+		pr_err("Keyboard type not supported by this build\n");
+		goto error_device_add;
+	}
+
+	if (kbd_led_state.mode == KB_TYPE_RGB)
+		static_branch_enable(&clevo_rgb_key);
 	
 	// Init state from params
 	
@@ -1017,19 +4122,30 @@ static int __init clevo_platform_init(void)
 	kbd_led_state.color.center = param_color_center;
 	kbd_led_state.color.right = param_color_right;
 	kbd_led_state.color.extra = param_color_extra;
-	if (kbd_led_state.mode == KB_TYPE_RGB) {
+	clevo_compositor_update(KBD_DIRTY_ZONES);
+	if (clevo_kbd_is_rgb()) {
 		if (param_brightness > BRIGHTNESS_MAX) param_brightness = BRIGHTNESS_DEFAULT;
 	}
 	
-	if (kbd_led_state.mode == KB_TYPE_BW) {
+	if (!clevo_kbd_is_rgb()) {
 		if (param_brightness > BRIGHTNESS_MAX_BW) param_brightness = BRIGHTNESS_DEFAULT_BW;
 	}
 
 	kbd_led_state.brightness = param_brightness;
-	kbd_led_state.blinking_pattern = param_blinking_pattern;
+	set_blinking_pattern(param_blinking_pattern);
 	kbd_led_state.enabled = param_state;
 
+	mutex_lock(&kbd_lock);
 	clevo_keyboard_write_state();
+	mutex_unlock(&kbd_lock);
+
+	clevo_als_init();
+	clevo_forced_off_init();
+	clevo_reactive_init();
+
+	if (misc_register(&clevo_ctl_device) != 0) {
+		pr_err("Control device registration failed\n");
+	}
 	
 	/*
 	pr_info("Has_extra: %d; Enabled %d; Brightness: %d; Blinking Pattern: %d; Color Pattern: %d; whole_kbd_color: %d;", kbd_led_state.has_extra, kbd_led_state.enabled, kbd_led_state.brightness, kbd_led_state.blinking_pattern, kbd_led_state.color.center, kbd_led_state.whole_kbd_color);
@@ -1040,31 +4156,55 @@ static int __init clevo_platform_init(void)
 	error_device_add:
 
 	platform_device_unregister(platform_device_clevo);
+	cancel_delayed_work_sync(&kbd_commit_work);
+	clevo_layers_exit();
 
 	error_device_alloc:
 
 	platform_driver_unregister(&platform_driver_clevo);
 
-	if (active_device) {
+	error_driver_register:
+
+	if (CLEVO_HAS_V2 && active_device) {
 		acpi_bus_unregister_driver(&clevo_acpi_driver);
 	}
 
+	if (CLEVO_HAS_V1 && model == CLEVO_MODEL_V1) {
+		wmi_remove_notify_handler(CLEVO_V1_EVENT_GUID);
+	}
+
+	// hotkeys may have started a fade until the handlers were gone
+	cancel_delayed_work_sync(&kbd_fade_work);
+	clevo_sched_exit();
+
 	return -ENODEV;
 }
 
 static void __exit clevo_platform_exit(void)
 {
 	pr_info("%s",__PRETTY_FUNCTION__);
+	clevo_lease_exit();
+	if (clevo_ctl_device.this_device)
+		misc_deregister(&clevo_ctl_device);
+	clevo_forced_off_exit();
+	clevo_reactive_exit();
+	clevo_als_exit();
 	platform_device_unregister(platform_device_clevo);
+	cancel_delayed_work_sync(&kbd_commit_work);
+	clevo_layers_exit();
 	platform_driver_unregister(&platform_driver_clevo);
 
-	if (active_device) {
+	if (CLEVO_HAS_V2 && active_device) {
 		acpi_bus_unregister_driver(&clevo_acpi_driver);
 	}
 	
-	if (model == CLEVO_MODEL_V1) {
+	if (CLEVO_HAS_V1 && model == CLEVO_MODEL_V1) {
 		wmi_remove_notify_handler(CLEVO_V1_EVENT_GUID);
 	}
+
+	// hotkeys may have started a fade until the handlers were gone
+	cancel_delayed_work_sync(&kbd_fade_work);
+	clevo_sched_exit();
 }
 
 module_init(clevo_platform_init);